@@ -9,25 +9,296 @@
 
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 #include <drm/drm_edid.h>
+#include <drm/drm_vma_manager.h>
+#include <linux/dma-buf.h>
 #include <linux/err.h>
+#include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/mutex.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/srcu.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
 #include <uapi/linux/udrm.h>
 #include "udrm.h"
 
 /* EDID consists of a base block and at most 0xff extensions */
 #define UDRM_MAX_EDID_SIZE (EDID_LENGTH * 0x100)
 
+/* modes userspace may pass to PLUG instead of deriving them from an EDID */
+#define UDRM_MAX_MODES 256
+
+/* bytes of pending events a cdev may accumulate before events are dropped */
+#define UDRM_EVENT_SPACE (64 * 1024)
+
+/* damage boxes a single dirty event may carry before it covers the whole fb */
+#define UDRM_DEFAULT_CLIPS 16
+#define UDRM_MAX_CLIPS 256
+
+/* bounds for the format and modifier lists declared at registration */
+#define UDRM_MAX_FORMATS 64
+#define UDRM_MAX_MODIFIERS 64
+
+/* mode_config limits, unless the controlling process picks its own */
+#define UDRM_DEFAULT_MIN_SIZE 128
+#define UDRM_DEFAULT_MAX_SIZE 4096
+#define UDRM_DEFAULT_DEPTH 24
+#define UDRM_MAX_SIZE 16384
+
+/* heads are addressed through possible_crtcs, which is a 32bit mask */
+#define UDRM_MAX_HEADS 32
+
+/* commands a single SUBMIT may carry */
+#define UDRM_MAX_SUBMIT 256
+
+/* REGISTER from before it took parameters, its argument had to be 0 */
+#define UDRM_CMD_REGISTER_V0 _IOWR(UDRM_IOCTL_MAGIC, 0x00, __u64)
+
+/* PLUG from before the fields starting at @head were appended */
+#define UDRM_CMD_PLUG_V0 _IOC(_IOC_READ | _IOC_WRITE, UDRM_IOCTL_MAGIC, 0x02, \
+			      offsetof(struct udrm_cmd_plug, head))
+
+/* bounds for a vblank period chosen by userspace */
+#define UDRM_MIN_VBLANK_NS (NSEC_PER_SEC / 1000)
+#define UDRM_MAX_VBLANK_NS NSEC_PER_SEC
+
+struct udrm_cdev_event *udrm_cdev_event_new(u32 type, size_t size)
+{
+	struct udrm_cdev_event *event;
+
+	/* keep events 8-byte aligned when batched into a single read */
+	size = ALIGN(size, 8);
+
+	event = kzalloc(offsetof(struct udrm_cdev_event, ev) + size,
+			GFP_KERNEL);
+	if (!event)
+		return NULL;
+
+	INIT_LIST_HEAD(&event->link);
+	event->size = size;
+	event->ev.base.type = type;
+	event->ev.base.length = size;
+
+	return event;
+}
+
+static bool udrm_cdev_queue_locked(struct udrm_cdev *cdev,
+				   struct udrm_cdev_event *event)
+{
+	lockdep_assert_held(&cdev->event_lock);
+
+	if (!event || event->size > cdev->event_space) {
+		++cdev->n_dropped;
+		return false;
+	}
+
+	cdev->event_space -= event->size;
+	list_add_tail(&event->link, &cdev->event_list);
+	return true;
+}
+
+void udrm_cdev_queue(struct udrm_cdev *cdev, struct udrm_cdev_event *event)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&cdev->event_lock, flags);
+	if (udrm_cdev_queue_locked(cdev, event))
+		event = NULL;
+	spin_unlock_irqrestore(&cdev->event_lock, flags);
+
+	wake_up_interruptible(&cdev->waitq);
+	kfree(event);
+}
+
+/*
+ * In mailbox mode, only the latest commit of each head is kept. Commits
+ * the controlling process never claimed are counted as dropped, and their
+ * damage carries over, so a claimed frame covers everything that changed
+ * since the previous claim.
+ */
+void udrm_cdev_queue_commit(struct udrm_cdev *cdev,
+			    struct drm_framebuffer *dfb,
+			    struct udrm_cdev_event *event)
+{
+	struct udrm_event_fb_commit *commit, *prev;
+	struct udrm_mailbox *mailbox;
+	unsigned long flags;
+	unsigned int i;
+
+	if (!cdev->mailboxes || !event) {
+		udrm_cdev_queue(cdev, event);
+		return;
+	}
+
+	commit = &event->ev.fb_commit;
+	mailbox = &cdev->mailboxes[commit->head];
+
+	spin_lock_irqsave(&cdev->event_lock, flags);
+	if (mailbox->commit) {
+		prev = &mailbox->commit->ev.fb_commit;
+		for (i = 0; dfb && i < prev->n_clips; ++i)
+			udrm_clips_merge(commit->clips, &commit->n_clips,
+					 cdev->max_clips, dfb, &prev->clips[i]);
+		commit->base.length = sizeof(*commit) +
+				      commit->n_clips * sizeof(*commit->clips);
+		++mailbox->n_dropped;
+	}
+	swap(event, mailbox->commit);
+	++mailbox->seq;
+	cdev->frames_ready |= BIT(commit->head);
+	spin_unlock_irqrestore(&cdev->event_lock, flags);
+
+	wake_up_interruptible(&cdev->waitq);
+	kfree(event);
+}
+
+static bool udrm_clip_overlaps(const struct drm_clip_rect *a,
+			       const struct drm_clip_rect *b)
+{
+	return a->x1 < b->x2 && b->x1 < a->x2 &&
+	       a->y1 < b->y2 && b->y1 < a->y2;
+}
+
+void udrm_clips_merge(struct drm_clip_rect *set,
+		      u32 *n_set,
+		      unsigned int max_clips,
+		      struct drm_framebuffer *dfb,
+		      const struct drm_clip_rect *clip)
+{
+	struct drm_clip_rect r = {
+		.x1 = min_t(u32, clip->x1, dfb->width),
+		.y1 = min_t(u32, clip->y1, dfb->height),
+		.x2 = min_t(u32, clip->x2, dfb->width),
+		.y2 = min_t(u32, clip->y2, dfb->height),
+	};
+	unsigned int i = 0;
+
+	if (r.x1 >= r.x2 || r.y1 >= r.y2)
+		return;
+
+	/*
+	 * Grow the new box by every box it overlaps and drop those from the
+	 * set. Restart whenever it grew, so the set stays free of overlaps.
+	 */
+	while (i < *n_set) {
+		if (udrm_clip_overlaps(&r, &set[i])) {
+			r.x1 = min(r.x1, set[i].x1);
+			r.y1 = min(r.y1, set[i].y1);
+			r.x2 = max(r.x2, set[i].x2);
+			r.y2 = max(r.y2, set[i].y2);
+			set[i] = set[--*n_set];
+			i = 0;
+		} else {
+			++i;
+		}
+	}
+
+	if (*n_set < max_clips) {
+		set[(*n_set)++] = r;
+	} else {
+		/* too fragmented to be useful, report the whole fb */
+		set[0].x1 = 0;
+		set[0].y1 = 0;
+		set[0].x2 = dfb->width;
+		set[0].y2 = dfb->height;
+		*n_set = 1;
+	}
+}
+
+static void udrm_dirty_merge_clips(struct udrm_event_dirty *dirty,
+				   unsigned int max_clips,
+				   struct drm_framebuffer *dfb,
+				   const struct drm_clip_rect *clips,
+				   unsigned int n_clips)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_clips; ++i)
+		udrm_clips_merge(dirty->clips, &dirty->n_clips, max_clips,
+				 dfb, &clips[i]);
+
+	dirty->base.length = sizeof(*dirty) +
+			     dirty->n_clips * sizeof(*dirty->clips);
+}
+
+void udrm_cdev_queue_dirty(struct udrm_cdev *cdev,
+			   struct drm_framebuffer *dfb,
+			   const struct drm_clip_rect *clips,
+			   unsigned int n_clips)
+{
+	struct drm_clip_rect full = {
+		.x2 = dfb->width,
+		.y2 = dfb->height,
+	};
+	struct udrm_cdev_event *event;
+	unsigned long flags;
+
+	/* no clips means the whole framebuffer is dirty */
+	if (!n_clips) {
+		clips = &full;
+		n_clips = 1;
+	}
+
+	/*
+	 * As long as the last queued event is an unread dirty event of the
+	 * same framebuffer, merge into it rather than queueing another one.
+	 */
+	spin_lock_irqsave(&cdev->event_lock, flags);
+	event = cdev->dirty;
+	if (event && event->ev.dirty.fb_id == dfb->base.id &&
+	    list_is_last(&event->link, &cdev->event_list)) {
+		udrm_dirty_merge_clips(&event->ev.dirty, cdev->max_clips,
+				       dfb, clips, n_clips);
+		spin_unlock_irqrestore(&cdev->event_lock, flags);
+		return;
+	}
+	spin_unlock_irqrestore(&cdev->event_lock, flags);
+
+	event = udrm_cdev_event_new(UDRM_EVENT_DIRTY,
+				    sizeof(event->ev.dirty) +
+				    cdev->max_clips * sizeof(*clips));
+	if (event) {
+		event->ev.dirty.fb_id = dfb->base.id;
+		udrm_dirty_merge_clips(&event->ev.dirty, cdev->max_clips,
+				       dfb, clips, n_clips);
+	}
+
+	spin_lock_irqsave(&cdev->event_lock, flags);
+	if (udrm_cdev_queue_locked(cdev, event)) {
+		cdev->dirty = event;
+		event = NULL;
+	}
+	spin_unlock_irqrestore(&cdev->event_lock, flags);
+
+	wake_up_interruptible(&cdev->waitq);
+	kfree(event);
+}
+
+static bool udrm_cdev_has_events(struct udrm_cdev *cdev)
+{
+	return !list_empty(&cdev->event_list) || READ_ONCE(cdev->n_dropped);
+}
+
 static struct udrm_cdev *udrm_cdev_free(struct udrm_cdev *cdev)
 {
+	struct udrm_cdev_event *event, *t;
+	unsigned int i;
+
 	if (cdev) {
+		list_for_each_entry_safe(event, t, &cdev->event_list, link)
+			kfree(event);
+		for (i = 0; i < cdev->n_mailboxes; ++i)
+			kfree(cdev->mailboxes[i].commit);
+		kfree(cdev->mailboxes);
 		udrm_device_unref(cdev->udrm);
+		mutex_destroy(&cdev->read_lock);
 		mutex_destroy(&cdev->lock);
-		kfree(cdev->edid);
 		kfree(cdev);
 	}
 
@@ -44,6 +315,11 @@ static struct udrm_cdev *udrm_cdev_new(void)
 		return ERR_PTR(-ENOMEM);
 
 	mutex_init(&cdev->lock);
+	mutex_init(&cdev->read_lock);
+	init_waitqueue_head(&cdev->waitq);
+	spin_lock_init(&cdev->event_lock);
+	INIT_LIST_HEAD(&cdev->event_list);
+	cdev->event_space = UDRM_EVENT_SPACE;
 
 	cdev->udrm = udrm_device_new(udrm_cdev_misc.this_device);
 	if (IS_ERR(cdev->udrm)) {
@@ -83,102 +359,733 @@ static int udrm_cdev_fop_release(struct inode *inode, struct file *file)
 
 static unsigned int udrm_cdev_fop_poll(struct file *file, poll_table *wait)
 {
-	return 0;
+	struct udrm_cdev *cdev = file->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(file, &cdev->waitq, wait);
+
+	if (udrm_cdev_has_events(cdev))
+		mask |= POLLIN | POLLRDNORM;
+
+	/* claimable frames are not events, read() would still block */
+	if (READ_ONCE(cdev->frames_ready))
+		mask |= POLLPRI;
+
+	return mask;
+}
+
+static ssize_t udrm_cdev_fop_read(struct file *file,
+				  char __user *buf,
+				  size_t count,
+				  loff_t *off)
+{
+	struct udrm_cdev *cdev = file->private_data;
+	struct udrm_event_overflow overflow;
+	struct udrm_cdev_event *event;
+	ssize_t r = 0;
+	size_t length;
+	u64 n_lost;
+
+	if (!access_ok(VERIFY_WRITE, buf, count))
+		return -EFAULT;
+
+	if (mutex_lock_interruptible(&cdev->read_lock))
+		return -ERESTARTSYS;
+
+	for (;;) {
+		event = NULL;
+		length = 0;
+
+		/*
+		 * Dropped events are reported first, so the reader knows its
+		 * view is incomplete before it looks at anything else. Events
+		 * that do not fit into the remaining buffer are left queued.
+		 */
+		spin_lock_irq(&cdev->event_lock);
+		if (cdev->n_dropped) {
+			length = sizeof(overflow);
+			if (length <= count - r) {
+				overflow.base.type = UDRM_EVENT_OVERFLOW;
+				overflow.base.length = length;
+				overflow.n_dropped = cdev->n_dropped;
+				cdev->n_dropped = 0;
+			}
+		} else if (!list_empty(&cdev->event_list)) {
+			event = list_first_entry(&cdev->event_list,
+						 struct udrm_cdev_event, link);
+			length = event->ev.base.length;
+			if (length <= count - r) {
+				list_del_init(&event->link);
+				cdev->event_space += event->size;
+				if (event == cdev->dirty)
+					cdev->dirty = NULL;
+			}
+		}
+		spin_unlock_irq(&cdev->event_lock);
+
+		if (!length) {
+			if (r)
+				break;
+			if (file->f_flags & O_NONBLOCK) {
+				r = -EAGAIN;
+				break;
+			}
+
+			mutex_unlock(&cdev->read_lock);
+			if (wait_event_interruptible(cdev->waitq,
+						udrm_cdev_has_events(cdev)))
+				return -ERESTARTSYS;
+			if (mutex_lock_interruptible(&cdev->read_lock))
+				return -ERESTARTSYS;
+			continue;
+		}
+
+		if (length > count - r) {
+			if (!r)
+				r = -EINVAL;
+			break;
+		}
+
+		if (event) {
+			n_lost = copy_to_user(buf + r, &event->ev, length) ?
+				 1 : 0;
+			kfree(event);
+		} else {
+			n_lost = copy_to_user(buf + r, &overflow, length) ?
+				 overflow.n_dropped : 0;
+		}
+
+		if (n_lost) {
+			/* whatever the caller failed to receive is reported */
+			spin_lock_irq(&cdev->event_lock);
+			cdev->n_dropped += n_lost;
+			spin_unlock_irq(&cdev->event_lock);
+			if (!r)
+				r = -EFAULT;
+			break;
+		}
+
+		r += length;
+	}
+
+	mutex_unlock(&cdev->read_lock);
+	return r;
 }
 
 static int udrm_cdev_fop_mmap(struct file *file, struct vm_area_struct *vma)
 {
-	return -EIO;
+	struct udrm_cdev *cdev = file->private_data;
+	struct udrm_bo *bo;
+	int r;
+
+	/* the controlling process only ever reads what clients scanned out */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	bo = udrm_bo_lookup_offset(cdev->udrm->ddev, vma->vm_pgoff,
+				   vma_pages(vma));
+	if (!bo)
+		return -EINVAL;
+
+	if (READ_ONCE(bo->cdev_mappable)) {
+		vma->vm_flags &= ~VM_MAYWRITE;
+		/* the consumer reads through cached mappings */
+		r = udrm_bo_mmap(bo, vma, false);
+	} else {
+		r = -EACCES;
+	}
+
+	drm_gem_object_unreference_unlocked(&bo->base);
+	return r;
 }
 
-static int udrm_cdev_ioctl_plug(struct udrm_cdev *cdev, unsigned long arg)
+struct udrm_plug *udrm_plug_free(struct udrm_plug *plug)
 {
-	struct udrm_cmd_plug param;
-	struct edid *edid;
+	if (plug) {
+		kfree(plug->modes);
+		kfree(plug->edid);
+		kfree(plug);
+	}
+
+	return NULL;
+}
+
+static struct udrm_head *udrm_cdev_head(struct udrm_cdev *cdev, u64 index)
+{
+	struct udrm_device *udrm = cdev->udrm;
+
+	if (unlikely(index >= udrm->n_heads))
+		return NULL;
+
+	return &udrm->heads[index];
+}
+
+static int udrm_cdev_plug_modes(struct udrm_plug *plug,
+				struct udrm_cmd_plug *param)
+{
+	struct drm_mode_modeinfo *umodes;
+	struct drm_display_mode *modes;
+	unsigned int i;
+	int r;
+
+	umodes = memdup_user((void __user *)param->ptr_modes,
+			     param->n_modes * sizeof(*umodes));
+	if (IS_ERR(umodes))
+		return PTR_ERR(umodes);
+
+	modes = kcalloc(param->n_modes, sizeof(*modes), GFP_KERNEL);
+	if (!modes) {
+		r = -ENOMEM;
+		goto exit;
+	}
+
+	for (i = 0; i < param->n_modes; ++i) {
+		r = drm_mode_convert_umode(&modes[i], &umodes[i]);
+		if (r < 0) {
+			kfree(modes);
+			goto exit;
+		}
+
+		modes[i].type = DRM_MODE_TYPE_DRIVER;
+		if (i == param->preferred_mode)
+			modes[i].type |= DRM_MODE_TYPE_PREFERRED;
+	}
+
+	/* explicit modes replace the ones derived from the EDID */
+	kfree(plug->modes);
+	plug->modes = modes;
+	plug->n_modes = param->n_modes;
+	r = 0;
+
+exit:
+	kfree(umodes);
+	return r;
+}
+
+/* @size is that of the caller's struct, anything beyond is left zero */
+static int udrm_cdev_ioctl_plug(struct udrm_cdev *cdev,
+				unsigned long arg,
+				size_t size)
+{
+	struct udrm_cmd_plug param = {};
+	struct udrm_plug *plug, *old;
+	struct udrm_head *head;
 	int r;
 
 	BUILD_BUG_ON(_IOC_SIZE(UDRM_CMD_PLUG) != sizeof(param));
 
-	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
+	if (copy_from_user(&param, (void __user *)arg, size))
 		return -EFAULT;
-	if (unlikely(param.flags) ||
-	    unlikely(param.n_edid > UDRM_MAX_EDID_SIZE))
+	if (unlikely(param.flags & ~UDRM_PLUG_REPLACE) ||
+	    unlikely(param.__pad) ||
+	    unlikely(param.n_edid > UDRM_MAX_EDID_SIZE) ||
+	    unlikely(param.n_modes > UDRM_MAX_MODES) ||
+	    unlikely(param.n_modes &&
+		     param.preferred_mode >= param.n_modes))
 		return -EINVAL;
 
-	if (unlikely(param.ptr_edid != (u64)(unsigned long)param.ptr_edid))
+	if (unlikely(param.ptr_edid != (u64)(unsigned long)param.ptr_edid) ||
+	    unlikely(param.ptr_modes != (u64)(unsigned long)param.ptr_modes))
 		return -EFAULT;
 
-	if (cdev->plugged)
+	head = udrm_cdev_head(cdev, param.head);
+	if (!head)
+		return -ENODEV;
+
+	old = rcu_dereference_protected(head->plug,
+					lockdep_is_held(&cdev->lock));
+	if (old && !(param.flags & UDRM_PLUG_REPLACE))
 		return -EALREADY;
 
-	if (!param.n_edid) {
-		edid = NULL;
-	} else {
-		edid = kmalloc(param.n_edid, GFP_KERNEL);
-		if (!edid)
-			return -ENOMEM;
+	plug = kzalloc(sizeof(*plug), GFP_KERNEL);
+	if (!plug)
+		return -ENOMEM;
 
-		if (copy_from_user(edid, (void __user *)param.ptr_edid,
+	if (param.n_edid) {
+		plug->edid = kmalloc(param.n_edid, GFP_KERNEL);
+		if (!plug->edid) {
+			r = -ENOMEM;
+			goto error;
+		}
+
+		if (copy_from_user(plug->edid, (void __user *)param.ptr_edid,
 				   param.n_edid)) {
 			r = -EFAULT;
 			goto error;
 		}
 
-		if (param.n_edid != EDID_LENGTH * (edid->extensions + 1))
-			return -EINVAL;
+		if (param.n_edid !=
+		    EDID_LENGTH * (plug->edid->extensions + 1)) {
+			r = -EINVAL;
+			goto error;
+		}
 
-		if (!drm_edid_is_valid(edid)) {
+		if (!drm_edid_is_valid(plug->edid)) {
 			r = -EINVAL;
 			goto error;
 		}
 	}
 
-	cdev->plugged = true;
-	udrm_device_hotplug(cdev->udrm);
+	r = udrm_kms_parse_plug(head, plug);
+	if (r < 0)
+		goto error;
+
+	if (param.n_modes) {
+		r = udrm_cdev_plug_modes(plug, &param);
+		if (r < 0)
+			goto error;
+	}
 
-	WARN_ON(cdev->edid);
-	cdev->edid = edid;
+	/* a replaced snapshot is swapped in place, with a single hotplug */
+	rcu_assign_pointer(head->plug, plug);
+	if (old) {
+		synchronize_srcu(&cdev->udrm->cdev_srcu);
+		udrm_plug_free(old);
+	}
+
+	udrm_kms_update_edid(head, plug->edid);
+	udrm_device_hotplug(cdev->udrm);
 
 	return 0;
 
 error:
-	kfree(edid);
+	udrm_plug_free(plug);
 	return r;
 }
 
-static int udrm_cdev_ioctl_unplug(struct udrm_cdev *cdev)
+static int udrm_cdev_ioctl_unplug(struct udrm_cdev *cdev, unsigned long arg)
 {
+	struct udrm_head *head;
+	struct udrm_plug *plug;
+
+	/* the argument is the index of the head, passed by value */
+	head = udrm_cdev_head(cdev, arg);
+	if (!head)
+		return -ENODEV;
 
-	if (!cdev->plugged)
+	plug = rcu_dereference_protected(head->plug,
+					 lockdep_is_held(&cdev->lock));
+	if (!plug)
 		return -EALREADY;
 
-	cdev->plugged = false;
+	RCU_INIT_POINTER(head->plug, NULL);
+	synchronize_srcu(&cdev->udrm->cdev_srcu);
+	udrm_plug_free(plug);
+
+	udrm_kms_update_edid(head, NULL);
 	udrm_device_hotplug(cdev->udrm);
+	return 0;
+}
+
+static int udrm_cdev_ioctl_map(struct udrm_cdev *cdev, unsigned long arg)
+{
+	struct dma_buf *dmabufs[UDRM_MAX_PLANES] = {};
+	struct udrm_cmd_map_plane *plane;
+	struct udrm_cmd_map param;
+	struct udrm_bo *bo;
+	struct udrm_fb *fb;
+	unsigned int i, j;
+	int r;
+
+	BUILD_BUG_ON(_IOC_SIZE(UDRM_CMD_MAP) != sizeof(param));
+
+	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags & ~UDRM_MAP_DMABUF))
+		return -EINVAL;
+
+	for (i = 0; i < UDRM_MAX_PLANES; ++i)
+		param.planes[i].dmabuf_fd = -1;
+
+	fb = udrm_fb_lookup(cdev->udrm, param.fb_id);
+	if (!fb)
+		return -ENOENT;
+
+	/* only framebuffers that were scanned out are exposed */
+	if (!READ_ONCE(fb->committed)) {
+		r = -EACCES;
+		goto exit;
+	}
+
+	param.format = fb->base.pixel_format;
+	param.width = fb->base.width;
+	param.height = fb->base.height;
+	param.n_planes = drm_format_num_planes(fb->base.pixel_format);
+
+	/* planes sharing a buffer object report the same map offset */
+	for (i = 0; i < param.n_planes; ++i) {
+		bo = fb->bos[i];
+		plane = &param.planes[i];
+
+		r = drm_gem_create_mmap_offset(&bo->base);
+		if (r < 0)
+			goto exit;
+
+		WRITE_ONCE(bo->cdev_mappable, true);
+
+		plane->pitch = fb->base.pitches[i];
+		plane->data_offset = fb->base.offsets[i];
+		plane->size = bo->base.size;
+		plane->map_offset =
+			drm_vma_node_offset_addr(&bo->base.vma_node);
+		plane->modifier = fb->base.modifier[i];
+
+		if (!(param.flags & UDRM_MAP_DMABUF))
+			continue;
+
+		/* planes sharing a buffer object share the dma-buf, too */
+		for (j = 0; j < i && fb->bos[j] != bo; ++j)
+			;
+		if (j < i) {
+			plane->dmabuf_fd = param.planes[j].dmabuf_fd;
+			continue;
+		}
+
+		/* dma-bufs exported to the controlling process are read-only */
+		dmabufs[i] = udrm_bo_export(bo);
+		if (IS_ERR(dmabufs[i])) {
+			r = PTR_ERR(dmabufs[i]);
+			dmabufs[i] = NULL;
+			goto exit;
+		}
+
+		r = get_unused_fd_flags(O_CLOEXEC);
+		if (r < 0)
+			goto exit;
+
+		plane->dmabuf_fd = r;
+	}
+
+	if (copy_to_user((void __user *)arg, &param, sizeof(param))) {
+		r = -EFAULT;
+		goto exit;
+	}
+
+	/* nothing can fail anymore, so hand out the file descriptors */
+	for (i = 0; i < UDRM_MAX_PLANES; ++i) {
+		if (dmabufs[i]) {
+			fd_install(param.planes[i].dmabuf_fd, dmabufs[i]->file);
+			dmabufs[i] = NULL;
+		}
+	}
+
+	r = 0;
+
+exit:
+	for (i = 0; i < UDRM_MAX_PLANES; ++i) {
+		if (dmabufs[i]) {
+			if (param.planes[i].dmabuf_fd >= 0)
+				put_unused_fd(param.planes[i].dmabuf_fd);
+			dma_buf_put(dmabufs[i]);
+		}
+	}
+	drm_framebuffer_unreference(&fb->base);
+	return r;
+}
+
+static int udrm_cdev_ioctl_access(struct udrm_cdev *cdev,
+				  unsigned long arg,
+				  bool begin)
+{
+	struct udrm_cmd_access param;
+	struct udrm_bo *bo;
+	struct udrm_fb *fb;
+	int r;
+
+	BUILD_BUG_ON(_IOC_SIZE(UDRM_CMD_BEGIN_ACCESS) != sizeof(param));
+	BUILD_BUG_ON(_IOC_SIZE(UDRM_CMD_END_ACCESS) != sizeof(param));
+
+	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags & ~UDRM_ACCESS_WRITE) ||
+	    unlikely(param.__pad))
+		return -EINVAL;
+
+	/* the controlling process only ever reads frames */
+	if (param.flags & UDRM_ACCESS_WRITE)
+		return -EPERM;
+
+	fb = udrm_fb_lookup(cdev->udrm, param.id);
+	if (!fb)
+		return -ENOENT;
+
+	if (!READ_ONCE(fb->committed)) {
+		r = -EACCES;
+		goto exit;
+	}
+
+	if (param.plane >= drm_format_num_planes(fb->base.pixel_format)) {
+		r = -EINVAL;
+		goto exit;
+	}
+
+	bo = fb->bos[param.plane];
+	if (begin)
+		r = udrm_bo_begin_access(bo, NULL, false, &param.seq);
+	else
+		r = udrm_bo_end_access(bo, NULL, false, &param.seq);
+	if (r < 0)
+		goto exit;
+
+	if (copy_to_user((void __user *)arg, &param, sizeof(param)))
+		r = -EFAULT;
+
+exit:
+	drm_framebuffer_unreference(&fb->base);
+	return r;
+}
+
+static bool udrm_depth_is_valid(u32 depth)
+{
+	switch (depth) {
+	case 8:
+	case 15:
+	case 16:
+	case 24:
+	case 30:
+	case 32:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static int udrm_cdev_ioctl_register(struct udrm_cdev *cdev, unsigned long arg)
+{
+	struct udrm_cmd_register param = {};
+	struct udrm_device *udrm = cdev->udrm;
+	u64 *modifiers = NULL;
+	u32 *formats = NULL;
+	unsigned int i;
+	int r;
+
+	BUILD_BUG_ON(_IOC_SIZE(UDRM_CMD_REGISTER) != sizeof(param));
+
+	/* a NULL argument selects the defaults */
+	if (arg && copy_from_user(&param, (void __user *)arg, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags & ~(UDRM_REGISTER_FLIP_ACK |
+				     UDRM_REGISTER_MAILBOX)) ||
+	    unlikely(param.max_clips > UDRM_MAX_CLIPS) ||
+	    unlikely(param.n_heads > UDRM_MAX_HEADS) ||
+	    unlikely(param.n_formats > UDRM_MAX_FORMATS) ||
+	    unlikely(param.n_modifiers > UDRM_MAX_MODIFIERS))
+		return -EINVAL;
+
+	/* a size of 0 selects the respective default */
+	param.min_width = param.min_width ?: UDRM_DEFAULT_MIN_SIZE;
+	param.min_height = param.min_height ?: UDRM_DEFAULT_MIN_SIZE;
+	param.max_width = param.max_width ?: UDRM_DEFAULT_MAX_SIZE;
+	param.max_height = param.max_height ?: UDRM_DEFAULT_MAX_SIZE;
+	param.preferred_depth = param.preferred_depth ?: UDRM_DEFAULT_DEPTH;
+	param.flip_depth = param.flip_depth ?: 1;
+
+	if (unlikely(param.flip_depth > UDRM_MAX_FLIP_DEPTH) ||
+	    unlikely(param.max_width > UDRM_MAX_SIZE) ||
+	    unlikely(param.max_height > UDRM_MAX_SIZE) ||
+	    unlikely(param.min_width > param.max_width) ||
+	    unlikely(param.min_height > param.max_height) ||
+	    unlikely(!udrm_depth_is_valid(param.preferred_depth)))
+		return -EINVAL;
+
+	if (unlikely(param.ptr_formats !=
+		     (u64)(unsigned long)param.ptr_formats) ||
+	    unlikely(param.ptr_modifiers !=
+		     (u64)(unsigned long)param.ptr_modifiers))
+		return -EFAULT;
 
-	kfree(cdev->edid);
-	cdev->edid = NULL;
+	/* no formats selects the defaults, no modifiers disables them */
+	if (param.n_formats) {
+		formats = memdup_user((void __user *)param.ptr_formats,
+				      param.n_formats * sizeof(*formats));
+		if (IS_ERR(formats))
+			return PTR_ERR(formats);
 
+		for (i = 0; i < param.n_formats; ++i) {
+			if (!udrm_kms_format_is_known(formats[i])) {
+				r = -EINVAL;
+				goto error;
+			}
+		}
+	}
+
+	if (param.n_modifiers) {
+		modifiers = memdup_user((void __user *)param.ptr_modifiers,
+					param.n_modifiers * sizeof(*modifiers));
+		if (IS_ERR(modifiers)) {
+			r = PTR_ERR(modifiers);
+			modifiers = NULL;
+			goto error;
+		}
+	}
+
+	/* a previous attempt might have left its mailboxes behind */
+	kfree(cdev->mailboxes);
+	cdev->mailboxes = NULL;
+	cdev->n_mailboxes = 0;
+
+	if (param.flags & UDRM_REGISTER_MAILBOX) {
+		cdev->mailboxes = kcalloc(param.n_heads ?: 1,
+					  sizeof(*cdev->mailboxes),
+					  GFP_KERNEL);
+		if (!cdev->mailboxes) {
+			r = -ENOMEM;
+			goto error;
+		}
+
+		cdev->n_mailboxes = param.n_heads ?: 1;
+	}
+
+	cdev->flags = param.flags;
+	cdev->flip_depth = param.flip_depth;
+	cdev->max_clips = param.max_clips ?: UDRM_DEFAULT_CLIPS;
+
+	/* a previous attempt might have failed with the device still new */
+	kfree(udrm->formats);
+	kfree(udrm->modifiers);
+	udrm->n_formats = param.n_formats;
+	udrm->formats = formats;
+	udrm->n_modifiers = param.n_modifiers;
+	udrm->modifiers = modifiers;
+	udrm->min_width = param.min_width;
+	udrm->min_height = param.min_height;
+	udrm->max_width = param.max_width;
+	udrm->max_height = param.max_height;
+	udrm->preferred_depth = param.preferred_depth;
+
+	return udrm_device_register(udrm, cdev, param.n_heads ?: 1);
+
+error:
+	kfree(modifiers);
+	kfree(formats);
+	return r;
+}
+
+static int udrm_cdev_ioctl_vblank(struct udrm_cdev *cdev, unsigned long arg)
+{
+	struct udrm_cmd_vblank param;
+	struct udrm_head *head;
+
+	BUILD_BUG_ON(_IOC_SIZE(UDRM_CMD_VBLANK) != sizeof(param));
+
+	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags) || unlikely(param.__pad))
+		return -EINVAL;
+
+	/* a period of 0 follows the refresh rate of the current mode */
+	if (param.period_ns && (param.period_ns < UDRM_MIN_VBLANK_NS ||
+				param.period_ns > UDRM_MAX_VBLANK_NS))
+		return -EINVAL;
+
+	head = udrm_cdev_head(cdev, param.head);
+	if (!head)
+		return -ENODEV;
+
+	udrm_kms_set_vblank(head, param.period_ns, param.phase_ns);
 	return 0;
 }
 
-static long udrm_cdev_fop_ioctl(struct file *file,
-				unsigned int cmd,
-				unsigned long arg)
+static int udrm_cdev_ioctl_flip_done(struct udrm_cdev *cdev, unsigned long arg)
 {
-	struct udrm_cdev *cdev = file->private_data;
+	struct udrm_head *head;
+
+	if (!(cdev->flags & UDRM_REGISTER_FLIP_ACK))
+		return -EINVAL;
+
+	/* the argument is the index of the head, passed by value */
+	head = udrm_cdev_head(cdev, arg);
+	if (!head)
+		return -ENODEV;
+
+	return udrm_kms_flip_done(head) ? 0 : -EALREADY;
+}
+
+static int udrm_cdev_ioctl_grab(struct udrm_cdev *cdev, unsigned long arg)
+{
+	struct udrm_event_fb_commit *commit;
+	struct udrm_cdev_event *event;
+	struct udrm_mailbox *mailbox;
+	struct drm_clip_rect *clip;
+	struct udrm_cmd_grab param;
+	unsigned int i, n;
 	int r = 0;
 
-	mutex_lock(&cdev->lock);
+	BUILD_BUG_ON(_IOC_SIZE(UDRM_CMD_GRAB) != sizeof(param));
+
+	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags) || unlikely(param.__pad))
+		return -EINVAL;
+
+	if (unlikely(param.ptr_clips != (u64)(unsigned long)param.ptr_clips))
+		return -EFAULT;
+
+	if (!cdev->mailboxes)
+		return -EINVAL;
+	if (param.head >= cdev->n_mailboxes)
+		return -ENODEV;
+
+	mailbox = &cdev->mailboxes[param.head];
+
+	spin_lock_irq(&cdev->event_lock);
+	event = mailbox->commit;
+	mailbox->commit = NULL;
+	param.seq = mailbox->seq;
+	param.n_dropped = mailbox->n_dropped;
+	mailbox->n_dropped = 0;
+	cdev->frames_ready &= ~BIT(param.head);
+	spin_unlock_irq(&cdev->event_lock);
+
+	if (!event)
+		return -EAGAIN;
+
+	commit = &event->ev.fb_commit;
+	param.fb_id = commit->fb_id;
+
+	if (commit->n_clips > param.n_clips && param.n_clips > 0) {
+		clip = &commit->clips[0];
+		for (i = 1; i < commit->n_clips; ++i) {
+			clip->x1 = min(clip->x1, commit->clips[i].x1);
+			clip->y1 = min(clip->y1, commit->clips[i].y1);
+			clip->x2 = max(clip->x2, commit->clips[i].x2);
+			clip->y2 = max(clip->y2, commit->clips[i].y2);
+		}
+		commit->n_clips = 1;
+	}
+
+	/* without any capacity, the damage is only counted */
+	n = min(param.n_clips, commit->n_clips);
+	param.n_clips = commit->n_clips;
+
+	if (copy_to_user((void __user *)param.ptr_clips, commit->clips,
+			 n * sizeof(*commit->clips)) ||
+	    copy_to_user((void __user *)arg, &param, sizeof(param)))
+		r = -EFAULT;
+
+	kfree(event);
+	return r;
+}
+
+static int udrm_cdev_dispatch(struct udrm_cdev *cdev,
+			      unsigned int cmd,
+			      unsigned long arg)
+{
+	int r = 0;
+
+	lockdep_assert_held(&cdev->lock);
+
 	switch (cmd) {
+	case UDRM_CMD_REGISTER_V0:
 	case UDRM_CMD_REGISTER:
 		if (udrm_device_is_registered(cdev->udrm))
 			r = -EISCONN;
 		else if (!udrm_device_is_new(cdev->udrm))
 			r = -ESHUTDOWN;
-		else if (unlikely(arg))
+		else if (cmd == UDRM_CMD_REGISTER_V0 && unlikely(arg))
 			r = -EINVAL;
 		else
-			r = udrm_device_register(cdev->udrm, cdev);
+			r = udrm_cdev_ioctl_register(cdev, arg);
 		break;
 	case UDRM_CMD_UNREGISTER:
 		if (udrm_device_is_new(cdev->udrm))
@@ -190,24 +1097,133 @@ static long udrm_cdev_fop_ioctl(struct file *file,
 		else
 			udrm_device_unregister(cdev->udrm);
 		break;
+	case UDRM_CMD_PLUG_V0:
 	case UDRM_CMD_PLUG:
 		if (!udrm_device_is_registered(cdev->udrm))
 			r = -ENOTCONN;
 		else
-			r = udrm_cdev_ioctl_plug(cdev, arg);
+			r = udrm_cdev_ioctl_plug(cdev, arg, _IOC_SIZE(cmd));
 		break;
 	case UDRM_CMD_UNPLUG:
 		if (!udrm_device_is_registered(cdev->udrm))
 			r = -ENOTCONN;
-		else if (unlikely(arg))
-			r = -EINVAL;
 		else
-			r = udrm_cdev_ioctl_unplug(cdev);
+			r = udrm_cdev_ioctl_unplug(cdev, arg);
+		break;
+	case UDRM_CMD_MAP:
+		if (!udrm_device_is_registered(cdev->udrm))
+			r = -ENOTCONN;
+		else
+			r = udrm_cdev_ioctl_map(cdev, arg);
+		break;
+	case UDRM_CMD_FLIP_DONE:
+		if (!udrm_device_is_registered(cdev->udrm))
+			r = -ENOTCONN;
+		else
+			r = udrm_cdev_ioctl_flip_done(cdev, arg);
+		break;
+	case UDRM_CMD_VBLANK:
+		if (!udrm_device_is_registered(cdev->udrm))
+			r = -ENOTCONN;
+		else
+			r = udrm_cdev_ioctl_vblank(cdev, arg);
+		break;
+	case UDRM_CMD_BEGIN_ACCESS:
+		if (!udrm_device_is_registered(cdev->udrm))
+			r = -ENOTCONN;
+		else
+			r = udrm_cdev_ioctl_access(cdev, arg, true);
+		break;
+	case UDRM_CMD_END_ACCESS:
+		if (!udrm_device_is_registered(cdev->udrm))
+			r = -ENOTCONN;
+		else
+			r = udrm_cdev_ioctl_access(cdev, arg, false);
+		break;
+	case UDRM_CMD_GRAB:
+		if (!udrm_device_is_registered(cdev->udrm))
+			r = -ENOTCONN;
+		else
+			r = udrm_cdev_ioctl_grab(cdev, arg);
 		break;
 	default:
 		r = -ENOTTY;
 		break;
 	}
+
+	return r;
+}
+
+static int udrm_cdev_ioctl_submit(struct udrm_cdev *cdev, unsigned long arg)
+{
+	struct udrm_submit_entry *entries;
+	struct udrm_cmd_submit param;
+	u64 i;
+	int r;
+
+	BUILD_BUG_ON(_IOC_SIZE(UDRM_CMD_SUBMIT) != sizeof(param));
+
+	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags & ~UDRM_SUBMIT_STOP_ON_ERROR) ||
+	    unlikely(param.n_entries > UDRM_MAX_SUBMIT))
+		return -EINVAL;
+
+	if (unlikely(param.ptr_entries !=
+		     (u64)(unsigned long)param.ptr_entries))
+		return -EFAULT;
+
+	if (!param.n_entries)
+		return 0;
+
+	entries = memdup_user((void __user *)param.ptr_entries,
+			      param.n_entries * sizeof(*entries));
+	if (IS_ERR(entries))
+		return PTR_ERR(entries);
+
+	for (i = 0; i < param.n_entries; ++i)
+		entries[i].result = -ECANCELED;
+
+	/*
+	 * Entries run in order, exactly as if issued as separate ioctls, but
+	 * without dropping the lock in between. Nested SUBMITs are not
+	 * dispatched and fail with -ENOTTY.
+	 */
+	for (i = 0; i < param.n_entries; ++i) {
+		if (unlikely(entries[i].arg !=
+			     (u64)(unsigned long)entries[i].arg))
+			r = -EFAULT;
+		else
+			r = udrm_cdev_dispatch(cdev, entries[i].cmd,
+					       entries[i].arg);
+
+		entries[i].result = r;
+		if (r < 0 && (param.flags & UDRM_SUBMIT_STOP_ON_ERROR))
+			break;
+	}
+
+	if (copy_to_user((void __user *)param.ptr_entries, entries,
+			 param.n_entries * sizeof(*entries)))
+		r = -EFAULT;
+	else
+		r = 0;
+
+	kfree(entries);
+	return r;
+}
+
+static long udrm_cdev_fop_ioctl(struct file *file,
+				unsigned int cmd,
+				unsigned long arg)
+{
+	struct udrm_cdev *cdev = file->private_data;
+	int r;
+
+	mutex_lock(&cdev->lock);
+	if (cmd == UDRM_CMD_SUBMIT)
+		r = udrm_cdev_ioctl_submit(cdev, arg);
+	else
+		r = udrm_cdev_dispatch(cdev, cmd, arg);
 	mutex_unlock(&cdev->lock);
 
 	return r;
@@ -218,6 +1234,7 @@ static const struct file_operations udrm_cdev_fops = {
 	.open		= udrm_cdev_fop_open,
 	.release	= udrm_cdev_fop_release,
 	.poll		= udrm_cdev_fop_poll,
+	.read		= udrm_cdev_fop_read,
 	.mmap		= udrm_cdev_fop_mmap,
 	.unlocked_ioctl	= udrm_cdev_fop_ioctl,
 	.compat_ioctl	= udrm_cdev_fop_ioctl,
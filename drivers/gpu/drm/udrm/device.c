@@ -11,29 +11,90 @@
 #include <drm/drmP.h>
 #include <drm/drm_crtc_helper.h>
 #include <drm/drm_gem.h>
+#include <drm/drm_vma_manager.h>
+#include <linux/fence.h>
 #include <linux/atomic.h>
 #include <linux/device.h>
 #include <linux/err.h>
 #include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/idr.h>
+#include <linux/jiffies.h>
 #include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/module.h>
 #include <linux/mutex.h>
-#include <linux/rwsem.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/srcu.h>
+#include <linux/workqueue.h>
 #include "udrm.h"
 
 static struct drm_driver udrm_drm_driver;
-static DEFINE_MUTEX(udrm_drm_lock);
+static DEFINE_SPINLOCK(udrm_minor_lock);
+static DEFINE_IDR(udrm_minor_idr);
+
+static unsigned int udrm_hotplug_delay_ms;
+module_param_named(hotplug_delay_ms, udrm_hotplug_delay_ms, uint, 0644);
+MODULE_PARM_DESC(hotplug_delay_ms,
+		 "Window in which hotplug events are merged, in ms (0: off)");
 
 static void udrm_device_free(struct device *dev)
 {
 	struct udrm_device *udrm = container_of(dev, struct udrm_device, dev);
+	unsigned int i;
 
-	WARN_ON(!IS_ERR_OR_NULL(udrm->cdev_unlocked));
+	WARN_ON(!IS_ERR_OR_NULL(rcu_access_pointer(udrm->cdev_unlocked)));
 	drm_dev_unref(udrm->ddev);
 	WARN_ON(udrm->n_bindings > 0);
+	udrm_bo_cache_destroy(&udrm->bo_cache);
+	for (i = 0; i < udrm->n_heads; ++i)
+		udrm_plug_free(rcu_dereference_protected(udrm->heads[i].plug,
+							 true));
+	kfree(udrm->heads);
+	kfree(udrm->modifiers);
+	kfree(udrm->formats);
+	mutex_destroy(&udrm->bind_lock);
+	cleanup_srcu_struct(&udrm->cdev_srcu);
 	kfree(udrm);
 }
 
+static int udrm_device_init_heads(struct udrm_device *udrm,
+				  unsigned int n_heads)
+{
+	struct udrm_head *head;
+	unsigned int i;
+
+	udrm->heads = kcalloc(n_heads, sizeof(*udrm->heads), GFP_KERNEL);
+	if (!udrm->heads)
+		return -ENOMEM;
+
+	udrm->n_heads = n_heads;
+
+	for (i = 0; i < n_heads; ++i) {
+		head = &udrm->heads[i];
+		head->udrm = udrm;
+		head->index = i;
+		spin_lock_init(&head->fence_lock);
+		head->fence_context = fence_context_alloc(1);
+		spin_lock_init(&head->vblank_lock);
+		hrtimer_init(&head->vblank_timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_ABS);
+		head->vblank_timer.function = udrm_kms_vblank_fn;
+	}
+
+	return 0;
+}
+
+static void udrm_device_hotplug_fn(struct work_struct *work)
+{
+	struct udrm_device *udrm = container_of(to_delayed_work(work),
+						struct udrm_device,
+						hotplug_work);
+
+	drm_kms_helper_hotplug_event(udrm->ddev);
+}
+
 struct udrm_device *udrm_device_new(struct device *parent)
 {
 	static atomic64_t id_counter;
@@ -44,10 +105,21 @@ struct udrm_device *udrm_device_new(struct device *parent)
 	if (!udrm)
 		return ERR_PTR(-ENOMEM);
 
+	r = init_srcu_struct(&udrm->cdev_srcu);
+	if (r < 0) {
+		kfree(udrm);
+		return ERR_PTR(r);
+	}
+
 	device_initialize(&udrm->dev);
 	udrm->dev.release = udrm_device_free;
 	udrm->dev.parent = parent;
-	init_rwsem(&udrm->cdev_lock);
+	mutex_init(&udrm->bind_lock);
+	INIT_DELAYED_WORK(&udrm->hotplug_work, udrm_device_hotplug_fn);
+
+	r = udrm_bo_cache_init(&udrm->bo_cache);
+	if (r < 0)
+		goto error;
 
 	r = dev_set_name(&udrm->dev, KBUILD_MODNAME "-%llu",
 			 (unsigned long long)atomic64_inc_return(&id_counter));
@@ -84,32 +156,108 @@ struct udrm_device *udrm_device_unref(struct udrm_device *udrm)
 	return NULL;
 }
 
-struct udrm_cdev *udrm_device_acquire(struct udrm_device *udrm)
+/*
+ * The controlling cdev is looked up from page-flip, vblank and probe paths,
+ * so lookups must neither sleep nor bounce a shared cacheline. Readers
+ * enter an SRCU read-side section, which only touches per-cpu counters,
+ * and the cdev is kept alive until they leave it. Unregistration swaps the
+ * pointer and waits for a grace period before the cdev is torn down.
+ * Writers wait for grace periods while holding cdev->lock, so readers must
+ * never take it.
+ */
+struct udrm_cdev *udrm_device_acquire(struct udrm_device *udrm, int *idx)
 {
+	struct udrm_cdev *cdev;
+
 	if (udrm) {
-		down_read(&udrm->cdev_lock);
-		if (!IS_ERR_OR_NULL(udrm->cdev_unlocked))
-			return udrm->cdev_unlocked;
-		up_read(&udrm->cdev_lock);
+		*idx = srcu_read_lock(&udrm->cdev_srcu);
+		cdev = srcu_dereference(udrm->cdev_unlocked, &udrm->cdev_srcu);
+		if (!IS_ERR_OR_NULL(cdev))
+			return cdev;
+		srcu_read_unlock(&udrm->cdev_srcu, *idx);
 	}
 
 	return NULL;
 }
 
 struct udrm_cdev *udrm_device_release(struct udrm_device *udrm,
-				      struct udrm_cdev *cdev)
+				      struct udrm_cdev *cdev,
+				      int idx)
 {
 	if (!cdev || WARN_ON(!udrm))
 		return NULL;
 
-	WARN_ON(cdev != udrm->cdev_unlocked);
-	up_read(&udrm->cdev_lock);
+	srcu_read_unlock(&udrm->cdev_srcu, idx);
 	return NULL;
 }
 
+static void udrm_device_retract(struct udrm_device *udrm)
+{
+	rcu_assign_pointer(udrm->cdev_unlocked, ERR_PTR(-ENODEV));
+	synchronize_srcu(&udrm->cdev_srcu);
+}
+
+/*
+ * DRM minors of registered devices are linked to their udrm device, so
+ * .open() can find the device and take its bind lock before it calls into
+ * drm_open(). Links only exist while the controlling cdev holds a
+ * reference, so taking another one during lookup is safe.
+ */
+static int udrm_device_link(struct udrm_device *udrm)
+{
+	struct drm_minor *minors[] = {
+		udrm->ddev->primary,
+		udrm->ddev->control,
+	};
+	size_t i;
+	int r = 0;
+
+	idr_preload(GFP_KERNEL);
+	spin_lock(&udrm_minor_lock);
+	for (i = 0; i < ARRAY_SIZE(minors); ++i) {
+		if (!minors[i])
+			continue;
+
+		r = idr_alloc(&udrm_minor_idr, udrm, minors[i]->index,
+			      minors[i]->index + 1, GFP_NOWAIT);
+		if (r < 0) {
+			while (i-- > 0)
+				if (minors[i])
+					idr_remove(&udrm_minor_idr,
+						   minors[i]->index);
+			break;
+		}
+	}
+	spin_unlock(&udrm_minor_lock);
+	idr_preload_end();
+
+	return r < 0 ? r : 0;
+}
+
+static void udrm_device_unlink(struct udrm_device *udrm)
+{
+	spin_lock(&udrm_minor_lock);
+	if (udrm->ddev->primary)
+		idr_remove(&udrm_minor_idr, udrm->ddev->primary->index);
+	if (udrm->ddev->control)
+		idr_remove(&udrm_minor_idr, udrm->ddev->control->index);
+	spin_unlock(&udrm_minor_lock);
+}
+
+static struct udrm_device *udrm_device_lookup(unsigned int minor)
+{
+	struct udrm_device *udrm;
+
+	spin_lock(&udrm_minor_lock);
+	udrm = udrm_device_ref(idr_find(&udrm_minor_idr, minor));
+	spin_unlock(&udrm_minor_lock);
+
+	return udrm;
+}
+
 static void udrm_device_unbind(struct udrm_device *udrm)
 {
-	lockdep_assert_held(&udrm_drm_lock);
+	lockdep_assert_held(&udrm->bind_lock);
 
 	if (!udrm || WARN_ON(udrm->n_bindings < 1) || --udrm->n_bindings > 0)
 		return;
@@ -122,7 +270,7 @@ static int udrm_device_bind(struct udrm_device *udrm)
 {
 	int r;
 
-	lockdep_assert_held(&udrm_drm_lock);
+	lockdep_assert_held(&udrm->bind_lock);
 
 	if (udrm->n_bindings < 1) {
 		r = udrm_kms_bind(udrm);
@@ -138,26 +286,31 @@ static int udrm_device_bind(struct udrm_device *udrm)
 
 bool udrm_device_is_new(struct udrm_device *udrm)
 {
-	return udrm && udrm->cdev_unlocked == NULL;
+	return udrm && !rcu_access_pointer(udrm->cdev_unlocked);
 }
 
 bool udrm_device_is_registered(struct udrm_device *udrm)
 {
-	return udrm && !IS_ERR_OR_NULL(udrm->cdev_unlocked);
+	return udrm &&
+	       !IS_ERR_OR_NULL(rcu_access_pointer(udrm->cdev_unlocked));
 }
 
-int udrm_device_register(struct udrm_device *udrm, struct udrm_cdev *cdev)
+int udrm_device_register(struct udrm_device *udrm,
+			 struct udrm_cdev *cdev,
+			 unsigned int n_heads)
 {
 	int r;
 
-	if (WARN_ON(!udrm_device_is_new(udrm)))
+	if (WARN_ON(!udrm_device_is_new(udrm)) || WARN_ON(udrm->heads))
 		return -ENOTRECOVERABLE;
 
-	down_write(&udrm->cdev_lock);
-	udrm->cdev_unlocked = cdev;
-	up_write(&udrm->cdev_lock);
+	r = udrm_device_init_heads(udrm, n_heads);
+	if (r < 0)
+		return r;
+
+	rcu_assign_pointer(udrm->cdev_unlocked, cdev);
 
-	mutex_lock(&udrm_drm_lock);
+	mutex_lock(&udrm->bind_lock);
 
 	r = udrm_device_bind(udrm);
 	if (r < 0)
@@ -167,50 +320,73 @@ int udrm_device_register(struct udrm_device *udrm, struct udrm_cdev *cdev)
 	if (r < 0)
 		goto exit_unbind;
 
-	r = drm_dev_register(udrm->ddev, 0);
+	r = udrm_device_link(udrm);
 	if (r < 0)
 		goto exit_del;
 
+	r = drm_dev_register(udrm->ddev, 0);
+	if (r < 0)
+		goto exit_unlink;
+
 	r = 0;
 	goto exit;
 
+exit_unlink:
+	udrm_device_unlink(udrm);
 exit_del:
 	device_del(&udrm->dev);
 exit_unbind:
 	udrm_device_unbind(udrm);
 exit_cleanup:
-	down_write(&udrm->cdev_lock);
-	udrm->cdev_unlocked = ERR_PTR(-ENODEV);
-	up_write(&udrm->cdev_lock);
+	udrm_device_retract(udrm);
 exit:
-	mutex_unlock(&udrm_drm_lock);
+	mutex_unlock(&udrm->bind_lock);
 	return r;
 }
 
 void udrm_device_unregister(struct udrm_device *udrm)
 {
+	unsigned int i;
+
 	if (udrm_device_is_registered(udrm)) {
-		down_write(&udrm->cdev_lock);
-		udrm->cdev_unlocked = ERR_PTR(-ENODEV);
-		up_write(&udrm->cdev_lock);
+		udrm_device_retract(udrm);
 
-		mutex_lock(&udrm_drm_lock);
+		/* the device is going away, pending hotplugs are moot */
+		cancel_delayed_work_sync(&udrm->hotplug_work);
+
+		/* nobody is left to acknowledge a held flip */
+		for (i = 0; i < udrm->n_heads; ++i)
+			udrm_kms_flip_done_all(&udrm->heads[i]);
+
+		mutex_lock(&udrm->bind_lock);
+		udrm_device_unlink(udrm);
 		drm_dev_unregister(udrm->ddev);
 		device_del(&udrm->dev);
 		udrm_device_unbind(udrm);
-		mutex_unlock(&udrm_drm_lock);
+		mutex_unlock(&udrm->bind_lock);
 	}
 }
 
+/*
+ * Brokers may churn plug state of many devices at once, and every hotplug
+ * event wakes udev and all compositors. If a window is configured, the
+ * first state change arms a delayed work and all further changes within
+ * the window are merged into the single event it sends.
+ */
 void udrm_device_hotplug(struct udrm_device *udrm)
 {
-	drm_kms_helper_hotplug_event(udrm->ddev);
+	unsigned int delay_ms = READ_ONCE(udrm_hotplug_delay_ms);
+
+	if (delay_ms)
+		schedule_delayed_work(&udrm->hotplug_work,
+				      msecs_to_jiffies(delay_ms));
+	else
+		drm_kms_helper_hotplug_event(udrm->ddev);
 }
 
 static int udrm_drm_fop_open(struct inode *inode, struct file *file)
 {
 	struct udrm_device *udrm;
-	struct drm_device *ddev;
 	int r;
 
 	/*
@@ -219,24 +395,28 @@ static int udrm_drm_fop_open(struct inode *inode, struct file *file)
 	 * step call into drm_open(). However, drm_minor_acquire() is not
 	 * exposed, so we have to lock manually:
 	 *
-	 *     We add the udrm_drm_lock as a guard that always makes sure the
-	 *     our bind/unbind calls are atomic with device registration. That
-	 *     is, we lock around udrm_drm_bind() and drm_dev_register(), as
-	 *     well as drm_dev_unregister() and udrm_drm_unbind(). This
+	 *     Each device has a bind_lock that always makes sure our
+	 *     bind/unbind calls are atomic with device registration. That is,
+	 *     we lock around udrm_device_bind() and drm_dev_register(), as
+	 *     well as drm_dev_unregister() and udrm_device_unbind(). This
 	 *     guarantees that here in .open() we know that between drm_open
-	 *     and udrm_device_bind() the device cannot be removed. This is the
-	 *     only purpose of udrm_drm_lock! Don't use it for anything else.
+	 *     and udrm_device_bind() the device cannot be removed. The device
+	 *     itself is found via its minor, before drm_open() is called, so
+	 *     opens only ever contend with other users of the same device.
+	 *     This is the only purpose of bind_lock! Don't use it for anything
+	 *     else.
 	 */
 
-	mutex_lock(&udrm_drm_lock);
+	udrm = udrm_device_lookup(iminor(inode));
+	if (!udrm)
+		return -ENODEV;
+
+	mutex_lock(&udrm->bind_lock);
 
 	r = drm_open(inode, file);
 	if (r < 0)
 		goto exit;
 
-	ddev = file->private_data;
-	udrm = ddev->dev_private;
-
 	r = udrm_device_bind(udrm);
 	if (r < 0) {
 		drm_release(inode, file);
@@ -246,37 +426,95 @@ static int udrm_drm_fop_open(struct inode *inode, struct file *file)
 	r = 0;
 
 exit:
-	mutex_unlock(&udrm_drm_lock);
+	mutex_unlock(&udrm->bind_lock);
+	udrm_device_unref(udrm);
 	return r;
 }
 
 static int udrm_drm_fop_release(struct inode *inode, struct file *file)
 {
-	struct drm_device *ddev = file->private_data;
-	struct udrm_device *udrm = ddev->dev_private;
+	struct drm_file *dfile = file->private_data;
+	struct udrm_device *udrm = dfile->minor->dev->dev_private;
 
-	mutex_lock(&udrm_drm_lock);
+	/* the last unbind might drop the last reference, so pin the device */
+	udrm_device_ref(udrm);
+	mutex_lock(&udrm->bind_lock);
 	drm_release(inode, file);
 	udrm_device_unbind(udrm);
-	mutex_unlock(&udrm_drm_lock);
+	mutex_unlock(&udrm->bind_lock);
+	udrm_device_unref(udrm);
 
 	return 0;
 }
 
+static int udrm_drm_fop_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct drm_file *dfile = file->private_data;
+	struct udrm_bo *bo;
+	int r;
+
+	bo = udrm_bo_lookup_offset(dfile->minor->dev, vma->vm_pgoff,
+				   vma_pages(vma));
+	if (!bo)
+		return -EINVAL;
+
+	/* offsets are only valid for files that own a handle to the object */
+	if (drm_vma_node_is_allowed(&bo->base.vma_node, dfile))
+		r = udrm_bo_mmap(bo, vma, bo->wc);
+	else
+		r = -EACCES;
+
+	drm_gem_object_unreference_unlocked(&bo->base);
+	return r;
+}
+
 static const struct file_operations udrm_drm_fops = {
 	.owner			= THIS_MODULE,
 	.llseek			= noop_llseek,
 	.open			= udrm_drm_fop_open,
 	.release		= udrm_drm_fop_release,
+	.unlocked_ioctl		= drm_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl		= drm_compat_ioctl,
+#endif
+	.mmap			= udrm_drm_fop_mmap,
+	.poll			= drm_poll,
+	.read			= drm_read,
+};
+
+static const struct drm_ioctl_desc udrm_drm_ioctls[] = {
+	DRM_IOCTL_DEF_DRV(UDRM_BEGIN_ACCESS, udrm_bo_ioctl_begin_access,
+			  DRM_UNLOCKED),
+	DRM_IOCTL_DEF_DRV(UDRM_END_ACCESS, udrm_bo_ioctl_end_access,
+			  DRM_UNLOCKED),
 };
 
 static struct drm_driver udrm_drm_driver = {
-	.driver_features = DRIVER_GEM | DRIVER_MODESET | DRIVER_ATOMIC,
+	.driver_features = DRIVER_GEM | DRIVER_MODESET | DRIVER_ATOMIC |
+			   DRIVER_PRIME,
 	.fops = &udrm_drm_fops,
-	.gem_free_object = udrm_bo_free,
+	.ioctls = udrm_drm_ioctls,
+	.num_ioctls = ARRAY_SIZE(udrm_drm_ioctls),
+	.gem_free_object_unlocked = udrm_bo_free,
+	.gem_close_object = udrm_bo_close,
+	.gem_vm_ops = &udrm_bo_vm_ops,
+	.prime_handle_to_fd = drm_gem_prime_handle_to_fd,
+	.prime_fd_to_handle = drm_gem_prime_fd_to_handle,
+	.gem_prime_export = drm_gem_prime_export,
+	.gem_prime_import = drm_gem_prime_import,
+	.gem_prime_pin = udrm_bo_pin,
+	.gem_prime_unpin = udrm_bo_unpin,
+	.gem_prime_get_sg_table = udrm_bo_get_sg_table,
+	.gem_prime_import_sg_table = udrm_bo_import_sg_table,
+	.gem_prime_vmap = udrm_bo_vmap,
+	.gem_prime_vunmap = udrm_bo_vunmap,
+	.gem_prime_mmap = udrm_bo_prime_mmap,
 	.dumb_create = udrm_dumb_create,
 	.dumb_map_offset = udrm_dumb_map_offset,
 	.dumb_destroy = drm_gem_dumb_destroy,
+	.get_vblank_counter = drm_vblank_no_hw_counter,
+	.enable_vblank = udrm_kms_enable_vblank,
+	.disable_vblank = udrm_kms_disable_vblank,
 	.name = "udrm",
 	.desc = "Virtual DRM Device Driver",
 	.date = "20160903",
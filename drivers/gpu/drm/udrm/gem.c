@@ -9,13 +9,339 @@
 
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 #include <drm/drmP.h>
+#include <drm/drm_cache.h>
+#include <drm/drm_vma_manager.h>
+#include <linux/bitmap.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
 #include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/highmem.h>
 #include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/pagemap.h>
+#include <linux/scatterlist.h>
+#include <linux/shmem_fs.h>
+#include <linux/shrinker.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
 #include "udrm.h"
 
-struct udrm_bo *udrm_bo_new(struct drm_device *ddev, size_t size)
+static unsigned int udrm_bo_cache_mb = 64;
+module_param_named(bo_cache_mb, udrm_bo_cache_mb, uint, 0644);
+MODULE_PARM_DESC(bo_cache_mb,
+		 "Per-device memory kept in freed buffers for reuse, in MiB");
+
+static bool udrm_bo_prefault;
+module_param_named(prefault, udrm_bo_prefault, bool, 0644);
+MODULE_PARM_DESC(prefault,
+		 "Populate buffers on creation and map them fully on mmap");
+
+struct udrm_bo_cache_entry {
+	struct hlist_node node;
+	struct list_head link;
+	struct file *filp;
+	size_t size;
+};
+
+static void udrm_bo_cache_evict_locked(struct udrm_bo_cache *cache,
+				       struct udrm_bo_cache_entry *entry,
+				       struct list_head *list)
+{
+	lockdep_assert_held(&cache->lock);
+
+	hash_del(&entry->node);
+	list_move(&entry->link, list);
+	cache->size -= entry->size;
+}
+
+static void udrm_bo_cache_release(struct list_head *list)
+{
+	struct udrm_bo_cache_entry *entry, *t;
+
+	list_for_each_entry_safe(entry, t, list, link) {
+		fput(entry->filp);
+		kfree(entry);
+	}
+}
+
+static unsigned long udrm_bo_cache_count(struct shrinker *shrinker,
+					 struct shrink_control *sc)
+{
+	struct udrm_bo_cache *cache = container_of(shrinker,
+						   struct udrm_bo_cache,
+						   shrinker);
+
+	return READ_ONCE(cache->size) >> PAGE_SHIFT;
+}
+
+static unsigned long udrm_bo_cache_scan(struct shrinker *shrinker,
+					struct shrink_control *sc)
+{
+	struct udrm_bo_cache *cache = container_of(shrinker,
+						   struct udrm_bo_cache,
+						   shrinker);
+	struct udrm_bo_cache_entry *entry;
+	unsigned long n_freed = 0;
+	LIST_HEAD(list);
+
+	spin_lock(&cache->lock);
+	while (n_freed < sc->nr_to_scan && !list_empty(&cache->lru)) {
+		entry = list_last_entry(&cache->lru,
+					struct udrm_bo_cache_entry, link);
+		n_freed += entry->size >> PAGE_SHIFT;
+		udrm_bo_cache_evict_locked(cache, entry, &list);
+	}
+	spin_unlock(&cache->lock);
+
+	udrm_bo_cache_release(&list);
+	return n_freed ?: SHRINK_STOP;
+}
+
+int udrm_bo_cache_init(struct udrm_bo_cache *cache)
+{
+	int r;
+
+	spin_lock_init(&cache->lock);
+	INIT_LIST_HEAD(&cache->lru);
+	hash_init(cache->buckets);
+	cache->shrinker.count_objects = udrm_bo_cache_count;
+	cache->shrinker.scan_objects = udrm_bo_cache_scan;
+	cache->shrinker.seeks = DEFAULT_SEEKS;
+
+	r = register_shrinker(&cache->shrinker);
+	if (r < 0)
+		return r;
+
+	cache->active = true;
+	return 0;
+}
+
+void udrm_bo_cache_destroy(struct udrm_bo_cache *cache)
+{
+	LIST_HEAD(list);
+
+	if (cache->active) {
+		unregister_shrinker(&cache->shrinker);
+		cache->active = false;
+	}
+
+	spin_lock(&cache->lock);
+	list_splice_init(&cache->lru, &list);
+	hash_init(cache->buckets);
+	cache->size = 0;
+	spin_unlock(&cache->lock);
+
+	udrm_bo_cache_release(&list);
+}
+
+/*
+ * Clear all resident pages, so the next owner of the shmem file cannot see
+ * what the previous one left. Pages that went to swap cannot be cleared in
+ * place, so such files are not reused at all. Neither are files with pages
+ * that are still referenced elsewhere, e.g. pinned by the previous owner
+ * through GUP, vmsplice() or O_DIRECT, as that owner would then see the
+ * frames of the next one. Such pages are freed with the file once their
+ * last reference is gone. Files are scrubbed when they are reused rather
+ * than when they are freed, as objects are released from many paths,
+ * including the commit tail, which should not be held up by a memset of
+ * the whole object. The cost lands on object creation instead, which
+ * would have to zero fresh pages anyway.
+ */
+static bool udrm_bo_cache_scrub(struct file *filp)
+{
+	struct inode *inode = file_inode(filp);
+	pgoff_t i, n_pages = i_size_read(inode) >> PAGE_SHIFT;
+	struct page *page;
+
+	if (READ_ONCE(SHMEM_I(inode)->swapped))
+		return false;
+
+	for (i = 0; i < n_pages; ++i) {
+		page = find_lock_page(inode->i_mapping, i);
+		if (!page)
+			continue;
+
+		/* page cache references, plus the one of this lookup */
+		if (page_count(page) >
+		    hpage_nr_pages(compound_head(page)) + 1) {
+			unlock_page(page);
+			put_page(page);
+			return false;
+		}
+
+		clear_highpage(page);
+		set_page_dirty(page);
+		unlock_page(page);
+		put_page(page);
+		cond_resched();
+	}
+
+	return !READ_ONCE(SHMEM_I(inode)->swapped);
+}
+
+static struct file *udrm_bo_cache_get(struct udrm_bo_cache *cache,
+				      size_t size)
+{
+	struct udrm_bo_cache_entry *entry, *found = NULL;
+	struct file *filp = NULL;
+
+	spin_lock(&cache->lock);
+	hash_for_each_possible(cache->buckets, entry, node, size) {
+		if (entry->size == size) {
+			hash_del(&entry->node);
+			list_del(&entry->link);
+			cache->size -= size;
+			found = entry;
+			break;
+		}
+	}
+	spin_unlock(&cache->lock);
+
+	if (found) {
+		filp = found->filp;
+		kfree(found);
+
+		if (!udrm_bo_cache_scrub(filp)) {
+			fput(filp);
+			filp = NULL;
+		}
+	}
+
+	return filp;
+}
+
+static bool udrm_bo_cache_put(struct udrm_bo_cache *cache,
+			      struct file *filp,
+			      size_t size)
+{
+	size_t max = (size_t)READ_ONCE(udrm_bo_cache_mb) << 20;
+	struct udrm_bo_cache_entry *entry;
+	LIST_HEAD(list);
+
+	/* files that are still referenced elsewhere must not be reused */
+	if (!cache->active || size > max || file_count(filp) != 1)
+		return false;
+
+	entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return false;
+
+	entry->filp = filp;
+	entry->size = size;
+
+	spin_lock(&cache->lock);
+	hash_add(cache->buckets, &entry->node, size);
+	list_add(&entry->link, &cache->lru);
+	cache->size += size;
+
+	while (cache->size > max) {
+		entry = list_last_entry(&cache->lru,
+					struct udrm_bo_cache_entry, link);
+		udrm_bo_cache_evict_locked(cache, entry, &list);
+	}
+	spin_unlock(&cache->lock);
+
+	udrm_bo_cache_release(&list);
+	return true;
+}
+
+/*
+ * Populating is merely an optimization, so errors are left to the fault
+ * handler to report. If shmem is configured for transparent huge pages,
+ * this is also where those get allocated.
+ */
+static void udrm_bo_populate(struct udrm_bo *bo)
+{
+	struct address_space *mapping = file_inode(bo->base.filp)->i_mapping;
+	pgoff_t i, n_pages = bo->base.size >> PAGE_SHIFT;
+	struct page *page;
+
+	for (i = 0; i < n_pages; ++i) {
+		page = shmem_read_mapping_page(mapping, i);
+		if (IS_ERR(page))
+			break;
+
+		put_page(page);
+		cond_resched();
+	}
+}
+
+/*
+ * Only the mappings of the producer, on DRM nodes, are write-combined. The
+ * consumer reads through cached mappings, and the kernel zeroes and scrubs
+ * the shmem pages through its cached linear map. Hence, lines of a page
+ * are flushed before it is mapped write-combined, so no dirty line can be
+ * evicted over the frame later. When a write ends, only pages that were
+ * ever mapped cached can have stale lines, so only those are flushed again.
+ * Pages that are not resident have no lines to flush.
+ */
+static void udrm_bo_flush(struct udrm_bo *bo)
+{
+	struct address_space *mapping = file_inode(bo->base.filp)->i_mapping;
+	pgoff_t i, n_pages = bo->base.size >> PAGE_SHIFT;
+	struct page *page;
+
+	for_each_set_bit(i, bo->cached_pages, n_pages) {
+		page = find_get_page(mapping, i);
+		if (!page)
+			continue;
+
+		drm_clflush_pages(&page, 1);
+		put_page(page);
+	}
+}
+
+/* records a cached mapping of a page, or flushes it for a WC one */
+static void udrm_bo_map_page(struct udrm_bo *bo,
+			     pgoff_t pgoff,
+			     struct page *page,
+			     bool wc)
+{
+	if (!bo->wc)
+		return;
+
+	if (wc)
+		drm_clflush_pages(&page, 1);
+	else
+		set_bit(pgoff, bo->cached_pages);
+}
+
+static void udrm_bo_prefault_vma(struct udrm_bo *bo,
+				 struct vm_area_struct *vma,
+				 pgoff_t pgoff,
+				 bool wc)
+{
+	struct address_space *mapping = file_inode(bo->base.filp)->i_mapping;
+	pgoff_t i, n_pages = vma_pages(vma);
+	struct page *page;
+	int r;
+
+	for (i = 0; i < n_pages; ++i) {
+		page = shmem_read_mapping_page(mapping, pgoff + i);
+		if (IS_ERR(page))
+			break;
+
+		udrm_bo_map_page(bo, pgoff + i, page, wc);
+
+		r = vm_insert_page(vma, vma->vm_start + (i << PAGE_SHIFT),
+				   page);
+		put_page(page);
+		if (r < 0)
+			break;
+	}
+}
+
+struct udrm_bo *udrm_bo_new(struct drm_device *ddev,
+			    size_t size,
+			    bool prefault)
 {
+	struct udrm_device *udrm = ddev->dev_private;
+	struct file *filp;
 	struct udrm_bo *bo;
 	int r;
 
@@ -25,39 +351,599 @@ struct udrm_bo *udrm_bo_new(struct drm_device *ddev, size_t size)
 	if (!bo)
 		return ERR_PTR(-ENOMEM);
 
-	r = drm_gem_object_init(ddev, &bo->base, size);
-	if (r < 0) {
-		kfree(bo);
-		return ERR_PTR(r);
+	/* recycle a shmem file, with its pages, of a freed object if any */
+	filp = udrm_bo_cache_get(&udrm->bo_cache, size);
+	if (filp) {
+		drm_gem_private_object_init(ddev, &bo->base, size);
+		bo->base.filp = filp;
+	} else {
+		r = drm_gem_object_init(ddev, &bo->base, size);
+		if (r < 0) {
+			kfree(bo);
+			return ERR_PTR(r);
+		}
 	}
 
+	mutex_init(&bo->lock);
+
+	/* the module parameter prefaults all objects, the flag single ones */
+	bo->prefault = prefault || READ_ONCE(udrm_bo_prefault);
+	if (bo->prefault)
+		udrm_bo_populate(bo);
+
 	return bo;
 }
 
 void udrm_bo_free(struct drm_gem_object *dobj)
 {
 	struct udrm_bo *bo = container_of(dobj, struct udrm_bo, base);
+	struct udrm_device *udrm = dobj->dev->dev_private;
+
+	if (dobj->import_attach)
+		drm_prime_gem_destroy(dobj, bo->sgt);
+	else if (udrm_bo_cache_put(&udrm->bo_cache, dobj->filp, dobj->size))
+		dobj->filp = NULL;
 
+	WARN_ON(bo->n_pins > 0);
+	WARN_ON(bo->export);
 	drm_gem_object_release(dobj);
+	mutex_destroy(&bo->lock);
+	kfree(bo->cached_pages);
 	kfree(bo);
 }
 
+struct udrm_bo *udrm_bo_lookup_offset(struct drm_device *ddev,
+				      unsigned long pgoff,
+				      unsigned long n_pages)
+{
+	struct drm_vma_offset_manager *mgr = ddev->vma_offset_manager;
+	struct drm_vma_offset_node *node;
+	struct drm_gem_object *dobj = NULL;
+
+	drm_vma_offset_lock_lookup(mgr);
+	node = drm_vma_offset_exact_lookup_locked(mgr, pgoff, n_pages);
+	if (node) {
+		dobj = container_of(node, struct drm_gem_object, vma_node);
+		if (!kref_get_unless_zero(&dobj->refcount))
+			dobj = NULL;
+	}
+	drm_vma_offset_unlock_lookup(mgr);
+
+	return dobj ? container_of(dobj, struct udrm_bo, base) : NULL;
+}
+
+/* @pgoff is the index of the faulting page within the object */
+static int udrm_bo_fault(struct drm_gem_object *dobj,
+			 pgoff_t pgoff,
+			 struct vm_fault *vmf,
+			 bool wc)
+{
+	struct udrm_bo *bo = container_of(dobj, struct udrm_bo, base);
+	struct page *page;
+
+	if (pgoff >= dobj->size >> PAGE_SHIFT)
+		return VM_FAULT_SIGBUS;
+
+	page = shmem_read_mapping_page(file_inode(dobj->filp)->i_mapping,
+				       pgoff);
+	if (IS_ERR(page)) {
+		switch (PTR_ERR(page)) {
+		case -ENOSPC:
+		case -ENOMEM:
+			return VM_FAULT_OOM;
+		case -EINTR:
+		case -EBUSY:
+			return VM_FAULT_NOPAGE;
+		default:
+			return VM_FAULT_SIGBUS;
+		}
+	}
+
+	udrm_bo_map_page(bo, pgoff, page, wc);
+
+	/* reference is transferred to the fault handler */
+	vmf->page = page;
+	return 0;
+}
+
+/* mappings of DRM and cdev nodes are placed at the fake offset */
+static int udrm_bo_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct drm_gem_object *dobj = vma->vm_private_data;
+
+	return udrm_bo_fault(dobj,
+			     vmf->pgoff - drm_vma_node_start(&dobj->vma_node),
+			     vmf, false);
+}
+
+static int udrm_bo_wc_vm_fault(struct vm_area_struct *vma,
+			       struct vm_fault *vmf)
+{
+	struct drm_gem_object *dobj = vma->vm_private_data;
+
+	return udrm_bo_fault(dobj,
+			     vmf->pgoff - drm_vma_node_start(&dobj->vma_node),
+			     vmf, true);
+}
+
+/* mappings of dma-bufs are placed at the offset within the object */
+static int udrm_bo_prime_vm_fault(struct vm_area_struct *vma,
+				  struct vm_fault *vmf)
+{
+	return udrm_bo_fault(vma->vm_private_data, vmf->pgoff, vmf, false);
+}
+
+const struct vm_operations_struct udrm_bo_vm_ops = {
+	.fault		= udrm_bo_vm_fault,
+	.open		= drm_gem_vm_open,
+	.close		= drm_gem_vm_close,
+};
+
+static const struct vm_operations_struct udrm_bo_wc_vm_ops = {
+	.fault		= udrm_bo_wc_vm_fault,
+	.open		= drm_gem_vm_open,
+	.close		= drm_gem_vm_close,
+};
+
+static const struct vm_operations_struct udrm_bo_prime_vm_ops = {
+	.fault		= udrm_bo_prime_vm_fault,
+	.open		= drm_gem_vm_open,
+	.close		= drm_gem_vm_close,
+};
+
+static int udrm_bo_mmap_at(struct udrm_bo *bo,
+			   struct vm_area_struct *vma,
+			   pgoff_t pgoff,
+			   bool wc,
+			   const struct vm_operations_struct *vm_ops)
+{
+	if (pgoff > bo->base.size >> PAGE_SHIFT ||
+	    vma_pages(vma) > (bo->base.size >> PAGE_SHIFT) - pgoff)
+		return -EINVAL;
+
+	/* imported objects have no shmem backing, the exporter maps them */
+	if (bo->base.import_attach)
+		return dma_buf_mmap(bo->base.import_attach->dmabuf, vma,
+				    pgoff);
+
+	/*
+	 * The pages are ordinary shmem pages, so we hand them out via
+	 * vmf->page and let the core mm track them. The vma pins the object
+	 * until it is closed, see drm_gem_vm_close().
+	 */
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_ops = vm_ops;
+	vma->vm_private_data = &bo->base;
+	vma->vm_page_prot = vm_get_page_prot(vma->vm_flags);
+	if (wc)
+		vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+	drm_gem_object_reference(&bo->base);
+
+	/* whatever is not mapped here is left to the fault handler */
+	if (bo->prefault)
+		udrm_bo_prefault_vma(bo, vma, pgoff, wc);
+
+	return 0;
+}
+
+/* offsets are looked up exactly, so the mapping starts at page 0 */
+int udrm_bo_mmap(struct udrm_bo *bo, struct vm_area_struct *vma, bool wc)
+{
+	return udrm_bo_mmap_at(bo, vma, 0, wc,
+			       wc ? &udrm_bo_wc_vm_ops : &udrm_bo_vm_ops);
+}
+
+int udrm_bo_pin(struct drm_gem_object *dobj)
+{
+	struct udrm_bo *bo = container_of(dobj, struct udrm_bo, base);
+	struct page **pages;
+	int r = 0;
+
+	mutex_lock(&bo->lock);
+	if (!bo->n_pins) {
+		pages = drm_gem_get_pages(dobj);
+		if (IS_ERR(pages)) {
+			r = PTR_ERR(pages);
+			goto exit;
+		}
+
+		bo->pages = pages;
+	}
+	++bo->n_pins;
+exit:
+	mutex_unlock(&bo->lock);
+	return r;
+}
+
+void udrm_bo_unpin(struct drm_gem_object *dobj)
+{
+	struct udrm_bo *bo = container_of(dobj, struct udrm_bo, base);
+
+	mutex_lock(&bo->lock);
+	if (!WARN_ON(bo->n_pins < 1) && --bo->n_pins < 1) {
+		/* importers might have written to the pages */
+		drm_gem_put_pages(dobj, bo->pages, true, false);
+		bo->pages = NULL;
+	}
+	mutex_unlock(&bo->lock);
+}
+
+struct sg_table *udrm_bo_get_sg_table(struct drm_gem_object *dobj)
+{
+	struct udrm_bo *bo = container_of(dobj, struct udrm_bo, base);
+	struct sg_table *sgt;
+
+	/* DRM pins the object on attach, before it maps it */
+	mutex_lock(&bo->lock);
+	if (WARN_ON(!bo->pages))
+		sgt = ERR_PTR(-EINVAL);
+	else
+		sgt = drm_prime_pages_to_sg(bo->pages,
+					    dobj->size >> PAGE_SHIFT);
+	mutex_unlock(&bo->lock);
+
+	return sgt;
+}
+
+struct drm_gem_object *
+udrm_bo_import_sg_table(struct drm_device *ddev,
+			struct dma_buf_attachment *attach,
+			struct sg_table *sgt)
+{
+	struct udrm_bo *bo;
+
+	bo = kzalloc(sizeof(*bo), GFP_KERNEL);
+	if (!bo)
+		return ERR_PTR(-ENOMEM);
+
+	drm_gem_private_object_init(ddev, &bo->base, attach->dmabuf->size);
+	mutex_init(&bo->lock);
+	bo->sgt = sgt;
+
+	return &bo->base;
+}
+
+void *udrm_bo_vmap(struct drm_gem_object *dobj)
+{
+	struct udrm_bo *bo = container_of(dobj, struct udrm_bo, base);
+	void *vaddr;
+
+	if (udrm_bo_pin(dobj) < 0)
+		return NULL;
+
+	vaddr = vmap(bo->pages, dobj->size >> PAGE_SHIFT, 0, PAGE_KERNEL);
+	if (!vaddr)
+		udrm_bo_unpin(dobj);
+	else if (bo->wc)
+		bitmap_fill(bo->cached_pages, dobj->size >> PAGE_SHIFT);
+
+	return vaddr;
+}
+
+void udrm_bo_vunmap(struct drm_gem_object *dobj, void *vaddr)
+{
+	vunmap(vaddr);
+	udrm_bo_unpin(dobj);
+}
+
+int udrm_bo_prime_mmap(struct drm_gem_object *dobj,
+		       struct vm_area_struct *vma)
+{
+	return udrm_bo_mmap_at(container_of(dobj, struct udrm_bo, base), vma,
+			       vma->vm_pgoff, false, &udrm_bo_prime_vm_ops);
+}
+
+static int udrm_bo_dmabuf_attach(struct dma_buf *dmabuf,
+				 struct device *dev,
+				 struct dma_buf_attachment *attach)
+{
+	struct udrm_bo *bo = dmabuf->priv;
+
+	return udrm_bo_pin(&bo->base);
+}
+
+static void udrm_bo_dmabuf_detach(struct dma_buf *dmabuf,
+				  struct dma_buf_attachment *attach)
+{
+	struct udrm_bo *bo = dmabuf->priv;
+
+	udrm_bo_unpin(&bo->base);
+}
+
+static struct sg_table *
+udrm_bo_dmabuf_map(struct dma_buf_attachment *attach,
+		   enum dma_data_direction dir)
+{
+	struct udrm_bo *bo = attach->dmabuf->priv;
+	struct sg_table *sgt;
+
+	sgt = udrm_bo_get_sg_table(&bo->base);
+	if (IS_ERR(sgt))
+		return sgt;
+
+	if (!dma_map_sg(attach->dev, sgt->sgl, sgt->nents, dir)) {
+		sg_free_table(sgt);
+		kfree(sgt);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	return sgt;
+}
+
+static void udrm_bo_dmabuf_unmap(struct dma_buf_attachment *attach,
+				 struct sg_table *sgt,
+				 enum dma_data_direction dir)
+{
+	dma_unmap_sg(attach->dev, sgt->sgl, sgt->nents, dir);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static void udrm_bo_dmabuf_release(struct dma_buf *dmabuf)
+{
+	struct udrm_bo *bo = dmabuf->priv;
+	struct udrm_device *udrm = bo->base.dev->dev_private;
+
+	mutex_lock(&bo->lock);
+	if (bo->export == dmabuf)
+		bo->export = NULL;
+	mutex_unlock(&bo->lock);
+
+	/* freeing the object needs the device, so drop that last */
+	drm_gem_object_unreference_unlocked(&bo->base);
+	udrm_device_unref(udrm);
+}
+
+/* like the DRM helpers, page-wise kernel mappings are not supported */
+static void *udrm_bo_dmabuf_kmap(struct dma_buf *dmabuf,
+				 unsigned long page_num)
+{
+	return NULL;
+}
+
+static int udrm_bo_dmabuf_mmap(struct dma_buf *dmabuf,
+			       struct vm_area_struct *vma)
+{
+	struct udrm_bo *bo = dmabuf->priv;
+
+	return udrm_bo_prime_mmap(&bo->base, vma);
+}
+
+static void *udrm_bo_dmabuf_vmap(struct dma_buf *dmabuf)
+{
+	struct udrm_bo *bo = dmabuf->priv;
+
+	return udrm_bo_vmap(&bo->base);
+}
+
+static void udrm_bo_dmabuf_vunmap(struct dma_buf *dmabuf, void *vaddr)
+{
+	struct udrm_bo *bo = dmabuf->priv;
+
+	udrm_bo_vunmap(&bo->base, vaddr);
+}
+
+static const struct dma_buf_ops udrm_bo_dmabuf_ops = {
+	.attach			= udrm_bo_dmabuf_attach,
+	.detach			= udrm_bo_dmabuf_detach,
+	.map_dma_buf		= udrm_bo_dmabuf_map,
+	.unmap_dma_buf		= udrm_bo_dmabuf_unmap,
+	.release		= udrm_bo_dmabuf_release,
+	.kmap_atomic		= udrm_bo_dmabuf_kmap,
+	.kmap			= udrm_bo_dmabuf_kmap,
+	.mmap			= udrm_bo_dmabuf_mmap,
+	.vmap			= udrm_bo_dmabuf_vmap,
+	.vunmap			= udrm_bo_dmabuf_vunmap,
+};
+
+/*
+ * The controlling process gets read-only dma-bufs of committed objects.
+ * Each object has at most one, so importers see the same buffer on every
+ * frame and can keep their imports around. The object does not hold a
+ * reference to it; the dma-buf clears the pointer on release. The dma-buf
+ * may outlive the cdev and all DRM files, so it pins the udrm device, and
+ * with it the DRM device, in addition to the object.
+ */
+struct dma_buf *udrm_bo_export(struct udrm_bo *bo)
+{
+	struct udrm_device *udrm = bo->base.dev->dev_private;
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct dma_buf *dmabuf;
+
+	/* the dma-buf of an imported object is writable, it is not ours */
+	if (bo->base.import_attach)
+		return ERR_PTR(-EPERM);
+
+	mutex_lock(&bo->lock);
+
+	/* a dma-buf that is being released cannot be revived */
+	dmabuf = bo->export;
+	if (dmabuf && get_file_rcu(dmabuf->file))
+		goto exit;
+
+	exp_info.ops = &udrm_bo_dmabuf_ops;
+	exp_info.size = bo->base.size;
+	exp_info.flags = O_RDONLY;
+	exp_info.priv = bo;
+
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf))
+		goto exit;
+
+	drm_gem_object_reference(&bo->base);
+	udrm_device_ref(udrm);
+	bo->export = dmabuf;
+
+exit:
+	mutex_unlock(&bo->lock);
+	return dmabuf;
+}
+
+/*
+ * CPU access is bracketed by BEGIN/END_ACCESS. One DRM file at a time may
+ * write an object; its sequence number is bumped on begin and on end, so
+ * it is odd while a frame is being written. Readers never block: BEGIN
+ * fails with -EBUSY during a write, and END fails with -EAGAIN if a write
+ * started since BEGIN, in which case the frame may be torn.
+ */
+static void udrm_bo_end_write_locked(struct udrm_bo *bo)
+{
+	lockdep_assert_held(&bo->lock);
+
+	/* drain write-combining buffers before the frame is declared stable */
+	if (bo->wc) {
+		wmb();
+		udrm_bo_flush(bo);
+	}
+
+	smp_store_release(&bo->access_seq, bo->access_seq + 1);
+	bo->access_writer = NULL;
+}
+
+int udrm_bo_begin_access(struct udrm_bo *bo,
+			 struct drm_file *dfile,
+			 bool write,
+			 u32 *seq)
+{
+	int r = 0;
+
+	if (!write) {
+		*seq = smp_load_acquire(&bo->access_seq);
+		return (*seq & 1) ? -EBUSY : 0;
+	}
+
+	mutex_lock(&bo->lock);
+	if (bo->access_writer) {
+		r = bo->access_writer == dfile ? -EALREADY : -EBUSY;
+	} else {
+		bo->access_writer = dfile;
+		WRITE_ONCE(bo->access_seq, bo->access_seq + 1);
+		smp_mb();
+		*seq = bo->access_seq;
+	}
+	mutex_unlock(&bo->lock);
+
+	return r;
+}
+
+int udrm_bo_end_access(struct udrm_bo *bo,
+		       struct drm_file *dfile,
+		       bool write,
+		       u32 *seq)
+{
+	int r = 0;
+
+	if (!write) {
+		smp_rmb();
+		return READ_ONCE(bo->access_seq) == *seq ? 0 : -EAGAIN;
+	}
+
+	mutex_lock(&bo->lock);
+	if (bo->access_writer == dfile) {
+		udrm_bo_end_write_locked(bo);
+		*seq = bo->access_seq;
+	} else {
+		r = -EINVAL;
+	}
+	mutex_unlock(&bo->lock);
+
+	return r;
+}
+
+/* writers that close their handle, or die, end their write implicitly */
+void udrm_bo_close(struct drm_gem_object *dobj, struct drm_file *dfile)
+{
+	struct udrm_bo *bo = container_of(dobj, struct udrm_bo, base);
+
+	mutex_lock(&bo->lock);
+	if (bo->access_writer == dfile)
+		udrm_bo_end_write_locked(bo);
+	mutex_unlock(&bo->lock);
+}
+
+static int udrm_bo_ioctl_access(struct drm_file *dfile,
+				struct udrm_cmd_access *param,
+				bool begin)
+{
+	struct drm_gem_object *dobj;
+	struct udrm_bo *bo;
+	bool write;
+	int r;
+
+	if (unlikely(param->flags & ~UDRM_ACCESS_WRITE) ||
+	    unlikely(param->plane) ||
+	    unlikely(param->__pad))
+		return -EINVAL;
+
+	dobj = drm_gem_object_lookup(dfile, param->id);
+	if (!dobj)
+		return -ENOENT;
+
+	bo = container_of(dobj, struct udrm_bo, base);
+	write = param->flags & UDRM_ACCESS_WRITE;
+	if (begin)
+		r = udrm_bo_begin_access(bo, dfile, write, &param->seq);
+	else
+		r = udrm_bo_end_access(bo, dfile, write, &param->seq);
+
+	drm_gem_object_unreference_unlocked(dobj);
+	return r;
+}
+
+int udrm_bo_ioctl_begin_access(struct drm_device *ddev,
+			       void *data,
+			       struct drm_file *dfile)
+{
+	return udrm_bo_ioctl_access(dfile, data, true);
+}
+
+int udrm_bo_ioctl_end_access(struct drm_device *ddev,
+			     void *data,
+			     struct drm_file *dfile)
+{
+	return udrm_bo_ioctl_access(dfile, data, false);
+}
+
 int udrm_dumb_create(struct drm_file *dfile,
 		     struct drm_device *ddev,
 		     struct drm_mode_create_dumb *args)
 {
 	struct udrm_bo *bo;
+	size_t n;
 	int r;
 
+	if (unlikely(args->flags & ~(UDRM_DUMB_WRITECOMBINE |
+				     UDRM_DUMB_PREFAULT)))
+		return -EINVAL;
+
 	/* overflow checks are done by DRM core */
 	args->pitch = DIV_ROUND_UP(args->bpp, 8) * args->width;
 	args->size = PAGE_ALIGN(args->pitch * args->height);
 
-	bo = udrm_bo_new(ddev, args->size);
+	bo = udrm_bo_new(ddev, args->size,
+			 args->flags & UDRM_DUMB_PREFAULT);
 	if (IS_ERR(bo))
 		return PTR_ERR(bo);
 
+	/*
+	 * Only applies to mappings of DRM nodes, see udrm_bo_flush(). Other
+	 * architectures either cannot mix cached and write-combined aliases
+	 * safely, or lack drm_clflush_pages(), so they keep cached mappings.
+	 */
+	if (IS_ENABLED(CONFIG_X86) &&
+	    (args->flags & UDRM_DUMB_WRITECOMBINE)) {
+		n = BITS_TO_LONGS(args->size >> PAGE_SHIFT);
+		bo->cached_pages = kcalloc(n, sizeof(long), GFP_KERNEL);
+		if (!bo->cached_pages) {
+			r = -ENOMEM;
+			goto exit;
+		}
+
+		bo->wc = true;
+	}
+
 	r = drm_gem_handle_create(dfile, &bo->base, &args->handle);
+exit:
 	drm_gem_object_unreference_unlocked(&bo->base);
 	return r;
 }
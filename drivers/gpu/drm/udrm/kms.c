@@ -9,44 +9,149 @@
 
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 #include <drm/drmP.h>
+#include <drm/drm_atomic.h>
 #include <drm/drm_atomic_helper.h>
 #include <drm/drm_crtc.h>
 #include <drm/drm_crtc_helper.h>
+#include <drm/drm_fourcc.h>
 #include <drm/drm_simple_kms_helper.h>
 #include <linux/err.h>
+#include <linux/fence.h>
+#include <linux/file.h>
+#include <linux/hrtimer.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/sync_file.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
 #include "udrm.h"
 
-/* XXX: should be provided by hw */
+/* refresh used for modes without a usable pixel clock */
+#define UDRM_VBLANK_DEFAULT_NS (NSEC_PER_SEC / 60)
+
+/* used if the controlling process does not declare any formats */
 static const uint32_t udrm_formats[] = {
 	DRM_FORMAT_ARGB8888,
 	DRM_FORMAT_XRGB8888,
 };
 
+/* formats the controlling process may declare */
+static const uint32_t udrm_known_formats[] = {
+	DRM_FORMAT_RGB565,
+	DRM_FORMAT_BGR565,
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_ARGB8888,
+	DRM_FORMAT_XBGR8888,
+	DRM_FORMAT_ABGR8888,
+	DRM_FORMAT_RGBX8888,
+	DRM_FORMAT_RGBA8888,
+	DRM_FORMAT_BGRX8888,
+	DRM_FORMAT_BGRA8888,
+	DRM_FORMAT_XRGB2101010,
+	DRM_FORMAT_ARGB2101010,
+	DRM_FORMAT_XBGR2101010,
+	DRM_FORMAT_ABGR2101010,
+	DRM_FORMAT_YUYV,
+	DRM_FORMAT_UYVY,
+	DRM_FORMAT_NV12,
+	DRM_FORMAT_NV21,
+	DRM_FORMAT_NV16,
+	DRM_FORMAT_NV61,
+	DRM_FORMAT_YUV420,
+	DRM_FORMAT_YVU420,
+};
+
+bool udrm_kms_format_is_known(u32 format)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(udrm_known_formats); ++i)
+		if (udrm_known_formats[i] == format)
+			return true;
+
+	return false;
+}
+
 static int udrm_conn_get_modes(struct drm_connector *conn)
 {
-	struct udrm_device *udrm = conn->dev->dev_private;
+	struct udrm_head *head = container_of(conn, struct udrm_head, conn);
+	struct udrm_device *udrm = head->udrm;
+	struct drm_display_mode *mode;
+	struct udrm_plug *plug;
 	struct udrm_cdev *cdev;
-	int r = 0;
+	unsigned int i;
+	int r = 0, idx;
 
-	cdev = udrm_device_acquire(udrm);
+	cdev = udrm_device_acquire(udrm, &idx);
 	if (cdev) {
-		mutex_lock(&cdev->lock);
-		r = drm_mode_connector_update_edid_property(conn, cdev->edid);
-		if (r < 0)
-			r = 0;
-		else
-			r = drm_add_edid_modes(conn, cdev->edid);
-		mutex_unlock(&cdev->lock);
-		udrm_device_release(udrm, cdev);
-	} else {
-		drm_mode_connector_update_edid_property(conn, NULL);
+		plug = srcu_dereference(head->plug, &udrm->cdev_srcu);
+		for (i = 0; plug && i < plug->n_modes; ++i) {
+			mode = drm_mode_duplicate(conn->dev, &plug->modes[i]);
+			if (!mode)
+				break;
+
+			drm_mode_probed_add(conn, mode);
+			++r;
+		}
+		udrm_device_release(udrm, cdev, idx);
+	}
+
+	return r;
+}
+
+/*
+ * Parse the EDID of @plug into its mode list. drm_add_edid_modes() can only
+ * operate on a connector, so this borrows the probed list of the head while
+ * holding the mode-config lock; probes leave that list empty. As a side
+ * effect, the display info of the connector is updated to the new EDID.
+ */
+int udrm_kms_parse_plug(struct udrm_head *head, struct udrm_plug *plug)
+{
+	struct drm_connector *conn = &head->conn;
+	struct drm_display_mode *mode, *tmp;
+	unsigned int n = 0;
+	int r = 0;
+
+	if (!plug->edid)
+		return 0;
+
+	mutex_lock(&conn->dev->mode_config.mutex);
+
+	WARN_ON(!list_empty(&conn->probed_modes));
+	drm_add_edid_modes(conn, plug->edid);
+
+	list_for_each_entry(mode, &conn->probed_modes, head)
+		++n;
+
+	if (n > 0) {
+		plug->modes = kcalloc(n, sizeof(*plug->modes), GFP_KERNEL);
+		if (!plug->modes)
+			r = -ENOMEM;
+	}
+
+	list_for_each_entry_safe(mode, tmp, &conn->probed_modes, head) {
+		if (!r)
+			drm_mode_copy(&plug->modes[plug->n_modes++], mode);
+		list_del(&mode->head);
+		drm_mode_destroy(conn->dev, mode);
 	}
 
+	mutex_unlock(&conn->dev->mode_config.mutex);
 	return r;
 }
 
+void udrm_kms_update_edid(struct udrm_head *head, struct edid *edid)
+{
+	struct drm_connector *conn = &head->conn;
+
+	mutex_lock(&conn->dev->mode_config.mutex);
+	drm_mode_connector_update_edid_property(conn, edid);
+	mutex_unlock(&conn->dev->mode_config.mutex);
+}
+
 static const struct drm_connector_helper_funcs udrm_conn_hops = {
 	.get_modes	= udrm_conn_get_modes,
 	.best_encoder	= drm_atomic_helper_best_encoder,
@@ -55,17 +160,17 @@ static const struct drm_connector_helper_funcs udrm_conn_hops = {
 static enum drm_connector_status udrm_conn_detect(struct drm_connector *conn,
 						  bool force)
 {
-	struct udrm_device *udrm = conn->dev->dev_private;
+	struct udrm_head *head = container_of(conn, struct udrm_head, conn);
+	struct udrm_device *udrm = head->udrm;
 	struct udrm_cdev *cdev;
 	enum drm_connector_status status = connector_status_disconnected;
+	int idx;
 
-	cdev = udrm_device_acquire(udrm);
+	cdev = udrm_device_acquire(udrm, &idx);
 	if (cdev) {
-		mutex_lock(&cdev->lock);
-		if (cdev->plugged)
+		if (rcu_access_pointer(head->plug))
 			status = connector_status_connected;
-		mutex_unlock(&cdev->lock);
-		udrm_device_release(udrm, cdev);
+		udrm_device_release(udrm, cdev, idx);
 	}
 
 	return status;
@@ -81,32 +186,381 @@ static const struct drm_connector_funcs udrm_conn_ops = {
 	.atomic_destroy_state	= drm_atomic_helper_connector_destroy_state,
 };
 
+static void udrm_kms_queue(struct udrm_device *udrm,
+			   struct udrm_cdev_event *event)
+{
+	struct udrm_cdev *cdev;
+	int idx;
+
+	cdev = udrm_device_acquire(udrm, &idx);
+	if (cdev) {
+		udrm_cdev_queue(cdev, event);
+		udrm_device_release(udrm, cdev, idx);
+	} else {
+		kfree(event);
+	}
+}
+
+static struct udrm_cdev_event *
+udrm_kms_commit_event(struct udrm_cdev *cdev,
+		      struct udrm_head *head,
+		      struct drm_plane_state *old_state)
+{
+	struct drm_simple_display_pipe *pipe = &head->pipe;
+	struct udrm_plane_state *state = to_udrm_plane_state(pipe->plane.state);
+	struct drm_framebuffer *dfb = state->base.fb;
+	const struct udrm_damage_rect *rects = NULL;
+	struct udrm_event_fb_commit *commit;
+	struct udrm_cdev_event *event;
+	struct drm_clip_rect clip;
+	size_t i, n_rects = 0;
+
+	event = udrm_cdev_event_new(UDRM_EVENT_FB_COMMIT,
+				    sizeof(*commit) +
+				    cdev->max_clips * sizeof(clip));
+	if (!event)
+		return NULL;
+
+	commit = &event->ev.fb_commit;
+	commit->head = head->index;
+	commit->fb_id = dfb ? dfb->base.id : 0;
+
+	/*
+	 * Damage is only meaningful relative to what was scanned out before,
+	 * so without a previous frame, or without any damage supplied, the
+	 * whole framebuffer is reported.
+	 */
+	if (state->damage && old_state->fb &&
+	    !drm_atomic_crtc_needs_modeset(pipe->crtc.state)) {
+		rects = (const struct udrm_damage_rect *)state->damage->data;
+		n_rects = state->damage->length / sizeof(*rects);
+	}
+
+	if (dfb && n_rects) {
+		for (i = 0; i < n_rects; ++i) {
+			clip.x1 = clamp_t(s32, rects[i].x1, 0, dfb->width);
+			clip.y1 = clamp_t(s32, rects[i].y1, 0, dfb->height);
+			clip.x2 = clamp_t(s32, rects[i].x2, 0, dfb->width);
+			clip.y2 = clamp_t(s32, rects[i].y2, 0, dfb->height);
+			udrm_clips_merge(commit->clips, &commit->n_clips,
+					 cdev->max_clips, dfb, &clip);
+		}
+	} else if (dfb) {
+		clip.x1 = 0;
+		clip.y1 = 0;
+		clip.x2 = dfb->width;
+		clip.y2 = dfb->height;
+		udrm_clips_merge(commit->clips, &commit->n_clips,
+				 cdev->max_clips, dfb, &clip);
+	}
+
+	commit->base.length = sizeof(*commit) +
+			      commit->n_clips * sizeof(clip);
+	return event;
+}
+
+static const char *udrm_fence_get_driver_name(struct fence *fence)
+{
+	return KBUILD_MODNAME;
+}
+
+static const char *udrm_fence_get_timeline_name(struct fence *fence)
+{
+	return "flip";
+}
+
+static bool udrm_fence_enable_signaling(struct fence *fence)
+{
+	return true;
+}
+
+static const struct fence_ops udrm_fence_ops = {
+	.get_driver_name	= udrm_fence_get_driver_name,
+	.get_timeline_name	= udrm_fence_get_timeline_name,
+	.enable_signaling	= udrm_fence_enable_signaling,
+	.wait			= fence_default_wait,
+};
+
+static struct fence *udrm_fence_new(struct udrm_head *head)
+{
+	struct fence *fence;
+
+	fence = kzalloc(sizeof(*fence), GFP_KERNEL);
+	if (fence)
+		fence_init(fence, &udrm_fence_ops, &head->fence_lock,
+			   head->fence_context, ++head->fence_seqno);
+
+	return fence;
+}
+
+static void udrm_fence_done(struct fence *fence)
+{
+	if (fence) {
+		fence_signal(fence);
+		fence_put(fence);
+	}
+}
+
+/*
+ * With FLIP_ACK, the controlling process holds up to flip_depth frames, and
+ * acknowledges each with FLIP_DONE, oldest first. Out-fences signal on
+ * acknowledgement. With a flip_depth of 2, a flip onto an idle head
+ * completes with the next vblank, so the client can render its next frame
+ * while the controlling process is still busy with this one. The flip
+ * that uses up the last credit is held until FLIP_DONE, as completing it
+ * would hand a frame that is still in use back to the client. Should a
+ * flip still be held when the next one arrives, the DRM core already gave
+ * up waiting for it, so the oldest frame is completed now.
+ *
+ * @event is cleared if the flip is held, otherwise the caller completes
+ * it. Takes ownership of @fence.
+ */
+static void udrm_kms_hold_flip(struct udrm_head *head,
+			       unsigned int depth,
+			       struct drm_pending_vblank_event **event,
+			       struct fence *fence)
+{
+	struct drm_device *ddev = head->udrm->ddev;
+	unsigned int slot;
+
+	if (head->n_flips >= depth)
+		udrm_kms_flip_done(head);
+
+	spin_lock_irq(&ddev->event_lock);
+	slot = (head->flip_first + head->n_flips) % UDRM_MAX_FLIP_DEPTH;
+	head->flip_fences[slot] = fence;
+	if (++head->n_flips >= depth && *event) {
+		WARN_ON(head->flip_event);
+		head->flip_event = *event;
+		*event = NULL;
+	}
+	spin_unlock_irq(&ddev->event_lock);
+}
+
+/* signals the out-fence of an armed vblank event, once that was sent */
+static void udrm_kms_vblank_fence_done(struct udrm_head *head, bool force)
+{
+	struct drm_device *ddev = head->udrm->ddev;
+	struct fence *fence = NULL;
+	unsigned long flags;
+	s32 delta;
+
+	spin_lock_irqsave(&ddev->event_lock, flags);
+	delta = drm_crtc_vblank_count(&head->pipe.crtc) -
+		head->vblank_fence_seq;
+	if (head->vblank_fence && (force || delta >= 0)) {
+		fence = head->vblank_fence;
+		head->vblank_fence = NULL;
+	}
+	spin_unlock_irqrestore(&ddev->event_lock, flags);
+
+	udrm_fence_done(fence);
+}
+
+/*
+ * Completes a flip with the next virtual vblank, or right away if vblanks
+ * are off. The out-fence signals along with the event, so clients see the
+ * same completion on both. Takes ownership of @event and @fence.
+ */
+static void udrm_kms_complete_flip(struct udrm_head *head,
+				   struct drm_pending_vblank_event *event,
+				   struct fence *fence)
+{
+	struct drm_device *ddev = head->udrm->ddev;
+	struct drm_crtc *crtc = &head->pipe.crtc;
+
+	if (!event) {
+		udrm_fence_done(fence);
+		return;
+	}
+
+	spin_lock_irq(&ddev->event_lock);
+	if (drm_crtc_vblank_get(crtc) == 0) {
+		drm_crtc_arm_vblank_event(crtc, event);
+		/* a fence still armed is overdue, it signals right away */
+		swap(fence, head->vblank_fence);
+		head->vblank_fence_seq = drm_crtc_vblank_count(crtc) + 1;
+	} else {
+		drm_crtc_send_vblank_event(crtc, event);
+	}
+	spin_unlock_irq(&ddev->event_lock);
+
+	udrm_fence_done(fence);
+}
+
 void udrm_display_pipe_update(struct drm_simple_display_pipe *pipe,
-			      struct drm_plane_state *plane_state)
+			      struct drm_plane_state *old_state)
 {
-	struct udrm_device *udrm = container_of(pipe, struct udrm_device, pipe);
+	struct udrm_head *head = container_of(pipe, struct udrm_head, pipe);
+	struct udrm_device *udrm = head->udrm;
+	struct drm_framebuffer *dfb = pipe->plane.state->fb;
+	struct drm_pending_vblank_event *event = NULL;
+	struct udrm_crtc_state *crtc_state;
+	struct fence *fence = NULL;
+	struct udrm_cdev *cdev;
+	unsigned int depth = 1;
+	bool hold = false;
+	int idx;
+
+	pipe->plane.fb = dfb;
+
+	/* once scanned out, the fb may be mapped by the controlling cdev */
+	if (dfb)
+		WRITE_ONCE(container_of(dfb, struct udrm_fb, base)->committed,
+			   true);
 
-	/* XXX: forward to hw */
-	pipe->plane.fb = pipe->plane.state->fb;
+	if (pipe->crtc.state) {
+		crtc_state = to_udrm_crtc_state(pipe->crtc.state);
+		event = crtc_state->base.event;
+		crtc_state->base.event = NULL;
+		fence = crtc_state->out_fence;
+		crtc_state->out_fence = NULL;
+	}
+
+	cdev = udrm_device_acquire(udrm, &idx);
+	if (cdev) {
+		udrm_cdev_queue_commit(cdev, dfb,
+				       udrm_kms_commit_event(cdev, head,
+							     old_state));
+		hold = cdev->flags & UDRM_REGISTER_FLIP_ACK;
+		depth = cdev->flip_depth;
+		udrm_device_release(udrm, cdev, idx);
+	}
 
-	if (pipe->crtc.state && pipe->crtc.state->event) {
-		spin_lock_irq(&udrm->ddev->event_lock);
-		drm_crtc_send_vblank_event(&pipe->crtc,
-					   pipe->crtc.state->event);
-		spin_unlock_irq(&udrm->ddev->event_lock);
-		pipe->crtc.state->event = NULL;
+	/* with FLIP_ACK, out-fences signal on acknowledgement */
+	if (hold) {
+		udrm_kms_hold_flip(head, depth, &event, fence);
+		fence = NULL;
 	}
+
+	udrm_kms_complete_flip(head, event, fence);
+}
+
+static u64 udrm_mode_period_ns(const struct drm_display_mode *mode)
+{
+	u64 period;
+
+	if (!mode->clock || !mode->htotal || !mode->vtotal)
+		return UDRM_VBLANK_DEFAULT_NS;
+
+	/* clock is given in kHz */
+	period = div_u64((u64)mode->htotal * mode->vtotal * 1000000,
+			 mode->clock);
+	return clamp_t(u64, period, 1, NSEC_PER_SEC);
+}
+
+static void udrm_vblank_restart_locked(struct udrm_head *head)
+{
+	u64 now, base, period = 0;
+	s32 rem;
+
+	lockdep_assert_held(&head->vblank_lock);
+
+	hrtimer_cancel(&head->vblank_timer);
+
+	if (head->vblank_mode_ns)
+		period = head->vblank_user_ns ?: head->vblank_mode_ns;
+
+	WRITE_ONCE(head->vblank_period_ns, period);
+	if (!period)
+		return;
+
+	/* phase-lock the next tick to the anchor, if userspace gave one */
+	now = ktime_get_ns();
+	base = head->vblank_phase_ns ?: head->vblank_base_ns;
+	div_s64_rem((s64)(now - base), period, &rem);
+	if (rem < 0)
+		rem += period;
+
+	hrtimer_start(&head->vblank_timer, ns_to_ktime(now + period - rem),
+		      HRTIMER_MODE_ABS);
+}
+
+enum hrtimer_restart udrm_kms_vblank_fn(struct hrtimer *timer)
+{
+	struct udrm_head *head = container_of(timer, struct udrm_head,
+					      vblank_timer);
+	u64 period = READ_ONCE(head->vblank_period_ns);
+
+	if (!period)
+		return HRTIMER_NORESTART;
+
+	drm_crtc_handle_vblank(&head->pipe.crtc);
+	udrm_kms_vblank_fence_done(head, false);
+	hrtimer_forward_now(timer, ns_to_ktime(period));
+	return HRTIMER_RESTART;
+}
+
+/*
+ * The vblank timer runs for as long as the pipe is enabled, regardless of
+ * whether anyone waits for vblanks. This keeps the counter and the phase
+ * steady, so there is nothing to do when DRM toggles vblank interrupts.
+ */
+int udrm_kms_enable_vblank(struct drm_device *ddev, unsigned int pipe)
+{
+	return 0;
+}
+
+void udrm_kms_disable_vblank(struct drm_device *ddev, unsigned int pipe)
+{
+}
+
+void udrm_kms_set_vblank(struct udrm_head *head,
+			 u64 period_ns,
+			 u64 phase_ns)
+{
+	spin_lock(&head->vblank_lock);
+	head->vblank_user_ns = period_ns;
+	head->vblank_phase_ns = phase_ns;
+	udrm_vblank_restart_locked(head);
+	spin_unlock(&head->vblank_lock);
 }
 
 static void udrm_display_pipe_enable(struct drm_simple_display_pipe *pipe,
 				     struct drm_crtc_state *crtc_state)
 {
-	/* XXX: forward to hw */
+	struct udrm_head *head = container_of(pipe, struct udrm_head, pipe);
+	struct udrm_cdev_event *event;
+
+	drm_calc_timestamping_constants(&pipe->crtc, &crtc_state->mode);
+
+	spin_lock(&head->vblank_lock);
+	head->vblank_base_ns = ktime_get_ns();
+	head->vblank_mode_ns = udrm_mode_period_ns(&crtc_state->mode);
+	udrm_vblank_restart_locked(head);
+	spin_unlock(&head->vblank_lock);
+
+	drm_crtc_vblank_on(&pipe->crtc);
+
+	event = udrm_cdev_event_new(UDRM_EVENT_PIPE_ENABLE,
+				    sizeof(event->ev.pipe_enable));
+	if (event) {
+		event->ev.pipe_enable.head = head->index;
+		drm_mode_convert_to_umode(&event->ev.pipe_enable.mode,
+					  &crtc_state->mode);
+	}
+	udrm_kms_queue(head->udrm, event);
 }
 
 static void udrm_display_pipe_disable(struct drm_simple_display_pipe *pipe)
 {
-	/* XXX: forward to hw */
+	struct udrm_head *head = container_of(pipe, struct udrm_head, pipe);
+	struct udrm_cdev_event *event;
+
+	udrm_kms_flip_done_all(head);
+	drm_crtc_vblank_off(&pipe->crtc);
+	udrm_kms_vblank_fence_done(head, true);
+
+	spin_lock(&head->vblank_lock);
+	head->vblank_mode_ns = 0;
+	udrm_vblank_restart_locked(head);
+	spin_unlock(&head->vblank_lock);
+
+	event = udrm_cdev_event_new(UDRM_EVENT_PIPE_DISABLE,
+				    sizeof(event->ev.pipe_disable));
+	if (event)
+		event->ev.pipe_disable.head = head->index;
+	udrm_kms_queue(head->udrm, event);
 }
 
 static const struct drm_simple_display_pipe_funcs udrm_pipe_ops = {
@@ -115,13 +569,221 @@ static const struct drm_simple_display_pipe_funcs udrm_pipe_ops = {
 	.disable	= udrm_display_pipe_disable,
 };
 
+static void udrm_plane_destroy_state(struct drm_plane *plane,
+				     struct drm_plane_state *plane_state)
+{
+	struct udrm_plane_state *state = to_udrm_plane_state(plane_state);
+
+	/* in-fences are dropped once waited for, unless the commit failed */
+	if (plane_state->fence) {
+		fence_put(plane_state->fence);
+		plane_state->fence = NULL;
+	}
+
+	__drm_atomic_helper_plane_destroy_state(plane_state);
+	drm_property_unreference_blob(state->damage);
+	kfree(state);
+}
+
+static void udrm_plane_reset(struct drm_plane *plane)
+{
+	struct udrm_plane_state *state;
+
+	if (plane->state) {
+		udrm_plane_destroy_state(plane, plane->state);
+		plane->state = NULL;
+	}
+
+	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	if (state) {
+		state->base.plane = plane;
+		state->base.rotation = DRM_ROTATE_0;
+		plane->state = &state->base;
+	}
+}
+
+static struct drm_plane_state *
+udrm_plane_duplicate_state(struct drm_plane *plane)
+{
+	struct udrm_plane_state *state;
+
+	if (WARN_ON(!plane->state))
+		return NULL;
+
+	/* damage is never carried over, it only applies to a single commit */
+	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	if (state)
+		__drm_atomic_helper_plane_duplicate_state(plane, &state->base);
+
+	return state ? &state->base : NULL;
+}
+
+static int udrm_plane_atomic_set_property(struct drm_plane *plane,
+					  struct drm_plane_state *plane_state,
+					  struct drm_property *prop,
+					  uint64_t val)
+{
+	struct udrm_plane_state *state = to_udrm_plane_state(plane_state);
+	struct udrm_device *udrm = plane->dev->dev_private;
+	struct drm_property_blob *blob = NULL;
+
+	if (prop == udrm->in_fence_prop) {
+		if ((s64)val == -1)
+			return 0;
+		if (plane_state->fence)
+			return -EINVAL;
+
+		/* the commit helpers wait for it before the plane is updated */
+		plane_state->fence = sync_file_get_fence(val);
+		return plane_state->fence ? 0 : -EINVAL;
+	}
+
+	if (prop != udrm->damage_prop)
+		return -EINVAL;
+
+	if (val) {
+		blob = drm_property_lookup_blob(plane->dev, val);
+		if (!blob)
+			return -EINVAL;
+
+		if (blob->length % sizeof(struct udrm_damage_rect)) {
+			drm_property_unreference_blob(blob);
+			return -EINVAL;
+		}
+	}
+
+	drm_property_unreference_blob(state->damage);
+	state->damage = blob;
+	return 0;
+}
+
+static int
+udrm_plane_atomic_get_property(struct drm_plane *plane,
+			       const struct drm_plane_state *plane_state,
+			       struct drm_property *prop,
+			       uint64_t *val)
+{
+	const struct udrm_plane_state *state = to_udrm_plane_state(plane_state);
+	struct udrm_device *udrm = plane->dev->dev_private;
+
+	if (prop == udrm->in_fence_prop) {
+		*val = (u64)-1;
+		return 0;
+	}
+
+	if (prop != udrm->damage_prop)
+		return -EINVAL;
+
+	*val = state->damage ? state->damage->base.id : 0;
+	return 0;
+}
+
+/* same as the simple-kms plane, with FB_DAMAGE_CLIPS and IN_FENCE_FD */
+static const struct drm_plane_funcs udrm_plane_ops = {
+	.update_plane		= drm_atomic_helper_update_plane,
+	.disable_plane		= drm_atomic_helper_disable_plane,
+	.destroy		= drm_plane_cleanup,
+	.reset			= udrm_plane_reset,
+	.set_property		= drm_atomic_helper_plane_set_property,
+	.atomic_duplicate_state	= udrm_plane_duplicate_state,
+	.atomic_destroy_state	= udrm_plane_destroy_state,
+	.atomic_set_property	= udrm_plane_atomic_set_property,
+	.atomic_get_property	= udrm_plane_atomic_get_property,
+};
+
+static void udrm_crtc_destroy_state(struct drm_crtc *crtc,
+				    struct drm_crtc_state *crtc_state)
+{
+	struct udrm_crtc_state *state = to_udrm_crtc_state(crtc_state);
+
+	/* out-fences of commits that failed signal here */
+	udrm_fence_done(state->out_fence);
+	__drm_atomic_helper_crtc_destroy_state(crtc_state);
+	kfree(state);
+}
+
+static void udrm_crtc_reset(struct drm_crtc *crtc)
+{
+	struct udrm_crtc_state *state;
+
+	if (crtc->state) {
+		udrm_crtc_destroy_state(crtc, crtc->state);
+		crtc->state = NULL;
+	}
+
+	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	if (state) {
+		state->base.crtc = crtc;
+		crtc->state = &state->base;
+	}
+}
+
+static struct drm_crtc_state *
+udrm_crtc_duplicate_state(struct drm_crtc *crtc)
+{
+	struct udrm_crtc_state *state;
+
+	if (WARN_ON(!crtc->state))
+		return NULL;
+
+	/* out-fences are never carried over, they belong to one commit */
+	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	if (state)
+		__drm_atomic_helper_crtc_duplicate_state(crtc, &state->base);
+
+	return state ? &state->base : NULL;
+}
+
+static int udrm_crtc_atomic_set_property(struct drm_crtc *crtc,
+					 struct drm_crtc_state *crtc_state,
+					 struct drm_property *prop,
+					 uint64_t val)
+{
+	struct udrm_crtc_state *state = to_udrm_crtc_state(crtc_state);
+	struct udrm_device *udrm = crtc->dev->dev_private;
+
+	if (prop != udrm->out_fence_prop)
+		return -EINVAL;
+
+	state->out_fence_ptr = u64_to_user_ptr(val);
+	return 0;
+}
+
+static int
+udrm_crtc_atomic_get_property(struct drm_crtc *crtc,
+			      const struct drm_crtc_state *crtc_state,
+			      struct drm_property *prop,
+			      uint64_t *val)
+{
+	struct udrm_device *udrm = crtc->dev->dev_private;
+
+	if (prop != udrm->out_fence_prop)
+		return -EINVAL;
+
+	*val = 0;
+	return 0;
+}
+
+/* same as the simple-kms crtc, but with OUT_FENCE_PTR support */
+static const struct drm_crtc_funcs udrm_crtc_ops = {
+	.reset			= udrm_crtc_reset,
+	.destroy		= drm_crtc_cleanup,
+	.set_config		= drm_atomic_helper_set_config,
+	.page_flip		= drm_atomic_helper_page_flip,
+	.set_property		= drm_atomic_helper_crtc_set_property,
+	.atomic_duplicate_state	= udrm_crtc_duplicate_state,
+	.atomic_destroy_state	= udrm_crtc_destroy_state,
+	.atomic_set_property	= udrm_crtc_atomic_set_property,
+	.atomic_get_property	= udrm_crtc_atomic_get_property,
+};
+
 static int udrm_fb_create_handle(struct drm_framebuffer *dfb,
 				 struct drm_file *dfile,
 				 unsigned int *handle)
 {
 	struct udrm_fb *fb = container_of(dfb, struct udrm_fb, base);
 
-	return drm_gem_handle_create(dfile, &fb->bo->base, handle);
+	return drm_gem_handle_create(dfile, &fb->bos[0]->base, handle);
 }
 
 static int udrm_fb_dirty(struct drm_framebuffer *dfb,
@@ -133,11 +795,12 @@ static int udrm_fb_dirty(struct drm_framebuffer *dfb,
 {
 	struct udrm_device *udrm = dfb->dev->dev_private;
 	struct udrm_cdev *cdev;
+	int idx;
 
-	cdev = udrm_device_acquire(udrm);
+	cdev = udrm_device_acquire(udrm, &idx);
 	if (cdev) {
-		/* XXX: report clips */
-		udrm_device_release(udrm, cdev);
+		udrm_cdev_queue_dirty(cdev, dfb, clips, n_clips);
+		udrm_device_release(udrm, cdev, idx);
 	}
 
 	return 0;
@@ -146,9 +809,12 @@ static int udrm_fb_dirty(struct drm_framebuffer *dfb,
 static void udrm_fb_destroy(struct drm_framebuffer *dfb)
 {
 	struct udrm_fb *fb = container_of(dfb, struct udrm_fb, base);
+	unsigned int i;
 
 	drm_framebuffer_cleanup(dfb);
-	drm_gem_object_unreference_unlocked(&fb->bo->base);
+	for (i = 0; i < ARRAY_SIZE(fb->bos); ++i)
+		if (fb->bos[i])
+			drm_gem_object_unreference_unlocked(&fb->bos[i]->base);
 	kfree(fb);
 }
 
@@ -158,106 +824,528 @@ static const struct drm_framebuffer_funcs udrm_fb_ops = {
 	.destroy		= udrm_fb_destroy,
 };
 
-struct udrm_fb *udrm_fb_new(struct udrm_bo *bo,
+static bool udrm_fb_has_modifier(struct udrm_device *udrm, u64 modifier)
+{
+	unsigned int i;
+
+	for (i = 0; i < udrm->n_modifiers; ++i)
+		if (udrm->modifiers[i] == modifier)
+			return true;
+
+	return false;
+}
+
+static int udrm_fb_validate(struct udrm_device *udrm,
+			    struct udrm_bo **bos,
+			    const struct drm_mode_fb_cmd2 *cmd)
+{
+	unsigned int i, n_planes, hsub, vsub, width, height, cpp;
+	u64 min_size;
+
+	if (cmd->flags & ~DRM_MODE_FB_MODIFIERS)
+		return -EINVAL;
+
+	n_planes = drm_format_num_planes(cmd->pixel_format);
+	hsub = drm_format_horz_chroma_subsampling(cmd->pixel_format);
+	vsub = drm_format_vert_chroma_subsampling(cmd->pixel_format);
+
+	for (i = 0; i < n_planes; ++i) {
+		/* modifiers are opaque to us, they only must be declared */
+		if ((cmd->flags & DRM_MODE_FB_MODIFIERS) &&
+		    !udrm_fb_has_modifier(udrm, cmd->modifier[i]))
+			return -EINVAL;
+
+		width = cmd->width / (i ? hsub : 1);
+		height = cmd->height / (i ? vsub : 1);
+		cpp = drm_format_plane_cpp(cmd->pixel_format, i);
+		min_size = (u64)(height - 1) * cmd->pitches[i] +
+			   (u64)width * cpp + cmd->offsets[i];
+		if (min_size > bos[i]->base.size)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+struct udrm_fb *udrm_fb_new(struct drm_device *ddev,
+			    struct udrm_bo **bos,
 			    const struct drm_mode_fb_cmd2 *cmd)
 {
+	unsigned int i, n_planes;
 	struct udrm_fb *fb;
 	int r;
 
-	if (cmd->flags)
-		return ERR_PTR(-EINVAL);
+	r = udrm_fb_validate(ddev->dev_private, bos, cmd);
+	if (r < 0)
+		return ERR_PTR(r);
 
 	fb = kzalloc(sizeof(*fb), GFP_KERNEL);
 	if (!fb)
-		return ERR_CAST(fb);
+		return ERR_PTR(-ENOMEM);
+
+	/* planes may share a buffer object, each of them holds a reference */
+	n_planes = drm_format_num_planes(cmd->pixel_format);
+	for (i = 0; i < n_planes; ++i) {
+		drm_gem_object_reference(&bos[i]->base);
+		fb->bos[i] = bos[i];
+	}
 
-	drm_gem_object_reference(&bo->base);
-	fb->bo = bo;
 	drm_helper_mode_fill_fb_struct(&fb->base, cmd);
 
-	r = drm_framebuffer_init(bo->base.dev, &fb->base, &udrm_fb_ops);
+	r = drm_framebuffer_init(ddev, &fb->base, &udrm_fb_ops);
 	if (r < 0)
 		goto error;
 
 	return fb;
 
 error:
-	drm_gem_object_unreference_unlocked(&bo->base);
+	for (i = 0; i < n_planes; ++i)
+		drm_gem_object_unreference_unlocked(&fb->bos[i]->base);
 	kfree(fb);
 	return ERR_PTR(r);
 }
 
+struct udrm_fb *udrm_fb_lookup(struct udrm_device *udrm, u32 id)
+{
+	struct drm_framebuffer *dfb;
+
+	dfb = drm_framebuffer_lookup(udrm->ddev, id);
+	if (!dfb)
+		return NULL;
+
+	if (dfb->funcs != &udrm_fb_ops) {
+		drm_framebuffer_unreference(dfb);
+		return NULL;
+	}
+
+	return container_of(dfb, struct udrm_fb, base);
+}
+
 static struct drm_framebuffer *udrm_fb_create(struct drm_device *ddev,
 					      struct drm_file *dfile,
 					      const struct drm_mode_fb_cmd2 *c)
 {
+	struct udrm_bo *bos[UDRM_MAX_PLANES] = {};
 	struct drm_gem_object *dobj;
+	unsigned int i, n_planes;
 	struct udrm_fb *fb;
 
-	dobj = drm_gem_object_lookup(dfile, c->handles[0]);
-	if (!dobj)
-		return ERR_PTR(-EINVAL);
+	n_planes = drm_format_num_planes(c->pixel_format);
+	for (i = 0; i < n_planes; ++i) {
+		dobj = drm_gem_object_lookup(dfile, c->handles[i]);
+		if (!dobj) {
+			fb = ERR_PTR(-EINVAL);
+			goto exit;
+		}
 
-	fb = udrm_fb_new(container_of(dobj, struct udrm_bo, base), c);
-	drm_gem_object_unreference_unlocked(dobj);
+		bos[i] = container_of(dobj, struct udrm_bo, base);
+	}
+
+	fb = udrm_fb_new(ddev, bos, c);
+
+exit:
+	for (i = 0; i < n_planes; ++i)
+		if (bos[i])
+			drm_gem_object_unreference_unlocked(&bos[i]->base);
 	return IS_ERR(fb) ? ERR_CAST(fb) : &fb->base;
 }
 
+/*
+ * Commits that do not update the plane of a pipe, like property changes or
+ * disabling the crtc alone, never reach udrm_display_pipe_update(). Their
+ * events and out-fences are completed here. This runs before hw_done, as
+ * until then no other commit can replace the crtc states.
+ */
+static void udrm_kms_complete_crtcs(struct drm_atomic_state *state)
+{
+	struct drm_crtc_state *old_state;
+	struct udrm_crtc_state *ustate;
+	struct drm_crtc *crtc;
+	struct fence *fence;
+	int i;
+
+	for_each_crtc_in_state(state, crtc, old_state, i) {
+		ustate = to_udrm_crtc_state(crtc->state);
+		fence = ustate->out_fence;
+		ustate->out_fence = NULL;
+		udrm_kms_complete_flip(container_of(crtc, struct udrm_head,
+						    pipe.crtc),
+				       ustate->base.event, fence);
+		ustate->base.event = NULL;
+	}
+}
+
+static void udrm_kms_commit_tail(struct drm_atomic_state *state)
+{
+	struct drm_device *ddev = state->dev;
+
+	drm_atomic_helper_wait_for_fences(ddev, state);
+	drm_atomic_helper_wait_for_dependencies(state);
+
+	/* same as drm_atomic_helper_commit_tail(), plus the completion */
+	drm_atomic_helper_commit_modeset_disables(ddev, state);
+	drm_atomic_helper_commit_planes(ddev, state, 0);
+	drm_atomic_helper_commit_modeset_enables(ddev, state);
+	udrm_kms_complete_crtcs(state);
+	drm_atomic_helper_commit_hw_done(state);
+	drm_atomic_helper_wait_for_vblanks(ddev, state);
+	drm_atomic_helper_cleanup_planes(ddev, state);
+
+	drm_atomic_helper_commit_cleanup_done(state);
+	drm_atomic_state_free(state);
+}
+
+static void udrm_kms_commit_work(struct work_struct *work)
+{
+	udrm_kms_commit_tail(container_of(work, struct drm_atomic_state,
+					  commit_work));
+}
+
+/*
+ * Same as drm_atomic_helper_commit(), but nonblocking commits run on the
+ * ordered workqueue of the device rather than a shared system queue, so
+ * commits of one device neither wait behind nor reorder with other work.
+ * How far clients may run ahead of the controlling process is governed
+ * by the flip depth, see udrm_kms_hold_flip().
+ */
+/*
+ * Waits for the in-fences of a commit that has not been swapped in yet, so
+ * a signal can still abort it. Waited-for fences are dropped, which leaves
+ * nothing for the commit tail to wait on.
+ */
+static int udrm_kms_wait_for_fences(struct drm_atomic_state *state)
+{
+	struct drm_plane_state *plane_state;
+	struct drm_plane *plane;
+	long r;
+	int i;
+
+	for_each_plane_in_state(state, plane, plane_state, i) {
+		if (!plane_state->fence)
+			continue;
+
+		r = fence_wait(plane_state->fence, true);
+		if (r < 0)
+			return r;
+
+		fence_put(plane_state->fence);
+		plane_state->fence = NULL;
+	}
+
+	return 0;
+}
+
+static int udrm_kms_commit(struct drm_device *ddev,
+			   struct drm_atomic_state *state,
+			   bool nonblock)
+{
+	struct udrm_device *udrm = ddev->dev_private;
+	int r;
+
+	r = drm_atomic_helper_setup_commit(state, nonblock);
+	if (r < 0)
+		return r;
+
+	INIT_WORK(&state->commit_work, udrm_kms_commit_work);
+
+	r = drm_atomic_helper_prepare_planes(ddev, state);
+	if (r < 0)
+		return r;
+
+	/* blocking commits wait for in-fences while they can still fail */
+	if (!nonblock) {
+		r = udrm_kms_wait_for_fences(state);
+		if (r < 0) {
+			drm_atomic_helper_cleanup_planes(ddev, state);
+			return r;
+		}
+	}
+
+	/* from here on, the commit cannot fail anymore */
+	drm_atomic_helper_swap_state(state, true);
+
+	if (nonblock)
+		queue_work(udrm->commit_wq, &state->commit_work);
+	else
+		udrm_kms_commit_tail(state);
+
+	return 0;
+}
+
+struct udrm_out_fence {
+	struct sync_file *sync_file;
+	int fd;
+};
+
+/*
+ * Out-fences are created and their fds reserved and written to userspace
+ * before the commit. The fds are only installed once the commit succeeded,
+ * as there is no way to take them back afterwards. The state might be
+ * gone by then, so everything needed later is tracked on the side.
+ */
+static int udrm_kms_atomic_commit(struct drm_device *ddev,
+				  struct drm_atomic_state *state,
+				  bool nonblock)
+{
+	struct udrm_device *udrm = ddev->dev_private;
+	struct drm_crtc_state *crtc_state;
+	struct udrm_crtc_state *ustate;
+	struct udrm_out_fence *out;
+	struct udrm_head *head;
+	struct drm_crtc *crtc;
+	bool fenced = false;
+	int i, r;
+
+	for_each_crtc_in_state(state, crtc, crtc_state, i)
+		if (to_udrm_crtc_state(crtc_state)->out_fence_ptr)
+			fenced = true;
+
+	if (!fenced)
+		return udrm_kms_commit(ddev, state, nonblock);
+
+	out = kcalloc(udrm->n_heads, sizeof(*out), GFP_KERNEL);
+	if (!out)
+		return -ENOMEM;
+
+	for (i = 0; i < udrm->n_heads; ++i)
+		out[i].fd = -1;
+
+	for_each_crtc_in_state(state, crtc, crtc_state, i) {
+		ustate = to_udrm_crtc_state(crtc_state);
+		if (!ustate->out_fence_ptr)
+			continue;
+
+		/* the state owns one reference, the sync_file another */
+		head = container_of(crtc, struct udrm_head, pipe.crtc);
+		ustate->out_fence = udrm_fence_new(head);
+		if (!ustate->out_fence) {
+			r = -ENOMEM;
+			goto error;
+		}
+
+		out[i].sync_file = sync_file_create(ustate->out_fence);
+		if (!out[i].sync_file) {
+			r = -ENOMEM;
+			goto error;
+		}
+
+		r = get_unused_fd_flags(O_CLOEXEC);
+		if (r < 0)
+			goto error;
+
+		out[i].fd = r;
+
+		if (put_user(out[i].fd, ustate->out_fence_ptr)) {
+			r = -EFAULT;
+			goto error;
+		}
+	}
+
+	r = udrm_kms_commit(ddev, state, nonblock);
+	if (r < 0)
+		goto error;
+
+	for (i = 0; i < udrm->n_heads; ++i)
+		if (out[i].sync_file)
+			fd_install(out[i].fd, out[i].sync_file->file);
+
+	kfree(out);
+	return 0;
+
+error:
+	for (i = 0; i < udrm->n_heads; ++i) {
+		if (out[i].fd >= 0)
+			put_unused_fd(out[i].fd);
+		if (out[i].sync_file)
+			fput(out[i].sync_file->file);
+	}
+	kfree(out);
+	return r;
+}
+
 static const struct drm_mode_config_funcs udrm_kms_ops = {
 	.fb_create		= udrm_fb_create,
 	.atomic_check		= drm_atomic_helper_check,
-	.atomic_commit		= drm_atomic_helper_commit,
+	.atomic_commit		= udrm_kms_atomic_commit,
 };
 
+static int udrm_kms_bind_head(struct udrm_head *head)
+{
+	struct drm_connector *conn = &head->conn;
+	struct udrm_device *udrm = head->udrm;
+	struct drm_device *ddev = udrm->ddev;
+	const uint32_t *formats = udrm_formats;
+	unsigned int n_formats = ARRAY_SIZE(udrm_formats);
+	int r;
+
+	if (udrm->n_formats) {
+		formats = udrm->formats;
+		n_formats = udrm->n_formats;
+	}
+
+	drm_connector_helper_add(conn, &udrm_conn_hops);
+
+	r = drm_connector_init(ddev, conn, &udrm_conn_ops,
+			       DRM_MODE_CONNECTOR_VIRTUAL);
+	if (r < 0)
+		return r;
+
+	/* XXX: should be provided by hw */
+	drm_object_attach_property(&conn->base,
+				   ddev->mode_config.dirty_info_property, 1);
+
+	r = drm_simple_display_pipe_init(ddev, &head->pipe, &udrm_pipe_ops,
+					 formats, n_formats, conn);
+	if (r < 0)
+		return r;
+
+	/*
+	 * The simple-kms helpers do not let us extend the plane or crtc
+	 * state, so we swap in our own funcs before the initial state is
+	 * allocated by drm_mode_config_reset().
+	 */
+	head->pipe.plane.funcs = &udrm_plane_ops;
+	head->pipe.crtc.funcs = &udrm_crtc_ops;
+
+	drm_object_attach_property(&head->pipe.plane.base,
+				   udrm->damage_prop, 0);
+	drm_object_attach_property(&head->pipe.plane.base,
+				   udrm->in_fence_prop, -1);
+	drm_object_attach_property(&head->pipe.crtc.base,
+				   udrm->out_fence_prop, 0);
+	return 0;
+}
+
 int udrm_kms_bind(struct udrm_device *udrm)
 {
-	struct drm_connector *conn = &udrm->conn;
 	struct drm_device *ddev = udrm->ddev;
+	unsigned int i;
 	int r;
 
 	if (WARN_ON(ddev->mode_config.funcs))
 		return -ENOTRECOVERABLE;
 
-	/* XXX: should be provided by hw */
+	r = drm_vblank_init(ddev, udrm->n_heads);
+	if (r < 0)
+		return r;
+
+	udrm->commit_wq = alloc_ordered_workqueue("%s", 0,
+						  dev_name(&udrm->dev));
+	if (!udrm->commit_wq) {
+		drm_vblank_cleanup(ddev);
+		return -ENOMEM;
+	}
+
 	drm_mode_config_init(ddev);
-	ddev->mode_config.min_width = 128;
-	ddev->mode_config.max_width = 4096;
-	ddev->mode_config.min_height = 128;
-	ddev->mode_config.max_height = 4096;
-	ddev->mode_config.preferred_depth = 24;
+	ddev->mode_config.min_width = udrm->min_width;
+	ddev->mode_config.max_width = udrm->max_width;
+	ddev->mode_config.min_height = udrm->min_height;
+	ddev->mode_config.max_height = udrm->max_height;
+	ddev->mode_config.preferred_depth = udrm->preferred_depth;
 	ddev->mode_config.funcs = &udrm_kms_ops;
-	drm_connector_helper_add(conn, &udrm_conn_hops);
+	ddev->mode_config.allow_fb_modifiers = udrm->n_modifiers > 0;
 
 	/* XXX: should be provided by hw */
 	r = drm_mode_create_dirty_info_property(ddev);
 	if (r < 0)
 		goto error;
 
-	r = drm_connector_init(ddev, conn, &udrm_conn_ops,
-			       DRM_MODE_CONNECTOR_VIRTUAL);
-	if (r < 0)
+	udrm->damage_prop = drm_property_create(ddev,
+						DRM_MODE_PROP_ATOMIC |
+						DRM_MODE_PROP_BLOB,
+						"FB_DAMAGE_CLIPS", 0);
+	if (!udrm->damage_prop) {
+		r = -ENOMEM;
 		goto error;
+	}
 
-	/* XXX: should be provided by hw */
-	drm_object_attach_property(&conn->base,
-				   ddev->mode_config.dirty_info_property, 1);
-
-	r = drm_simple_display_pipe_init(ddev, &udrm->pipe, &udrm_pipe_ops,
-					 udrm_formats, ARRAY_SIZE(udrm_formats),
-					 conn);
-	if (r < 0)
+	/* explicit fencing, named after the core properties of later kernels */
+	udrm->in_fence_prop = drm_property_create_signed_range(ddev,
+						DRM_MODE_PROP_ATOMIC,
+						"IN_FENCE_FD", -1, INT_MAX);
+	udrm->out_fence_prop = drm_property_create_range(ddev,
+						DRM_MODE_PROP_ATOMIC,
+						"OUT_FENCE_PTR", 0, U64_MAX);
+	if (!udrm->in_fence_prop || !udrm->out_fence_prop) {
+		r = -ENOMEM;
 		goto error;
+	}
+
+	for (i = 0; i < udrm->n_heads; ++i) {
+		r = udrm_kms_bind_head(&udrm->heads[i]);
+		if (r < 0)
+			goto error;
+	}
 
 	drm_mode_config_reset(ddev);
 	return 0;
 
 error:
 	drm_mode_config_cleanup(ddev);
+	destroy_workqueue(udrm->commit_wq);
+	udrm->commit_wq = NULL;
+	drm_vblank_cleanup(ddev);
 	return r;
 }
 
+bool udrm_kms_flip_done(struct udrm_head *head)
+{
+	struct drm_device *ddev = head->udrm->ddev;
+	struct drm_pending_vblank_event *event;
+	struct fence *fence;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ddev->event_lock, flags);
+	if (!head->n_flips) {
+		spin_unlock_irqrestore(&ddev->event_lock, flags);
+		return false;
+	}
+
+	/* acknowledge the oldest frame, which returns a credit */
+	fence = head->flip_fences[head->flip_first];
+	head->flip_fences[head->flip_first] = NULL;
+	head->flip_first = (head->flip_first + 1) % UDRM_MAX_FLIP_DEPTH;
+	--head->n_flips;
+
+	event = head->flip_event;
+	head->flip_event = NULL;
+	if (event)
+		drm_crtc_send_vblank_event(&head->pipe.crtc, event);
+	spin_unlock_irqrestore(&ddev->event_lock, flags);
+
+	udrm_fence_done(fence);
+	return true;
+}
+
+void udrm_kms_flip_done_all(struct udrm_head *head)
+{
+	while (udrm_kms_flip_done(head))
+		;
+}
+
 void udrm_kms_unbind(struct udrm_device *udrm)
 {
+	unsigned int i;
+
+	/* pending commits still need vblanks to complete */
+	if (udrm->commit_wq) {
+		destroy_workqueue(udrm->commit_wq);
+		udrm->commit_wq = NULL;
+	}
+
+	/*
+	 * A commit that saw the cdev before it was retracted may have held
+	 * its flip after udrm_device_unregister() released the held ones.
+	 * With the commits flushed, nothing can be held anymore after this.
+	 */
+	for (i = 0; i < udrm->n_heads; ++i) {
+		udrm_kms_flip_done_all(&udrm->heads[i]);
+		hrtimer_cancel(&udrm->heads[i].vblank_timer);
+		udrm_kms_vblank_fence_done(&udrm->heads[i], true);
+	}
+
 	if (udrm->ddev->mode_config.funcs)
 		drm_mode_config_cleanup(udrm->ddev);
+
+	drm_vblank_cleanup(udrm->ddev);
 }
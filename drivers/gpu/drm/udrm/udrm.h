@@ -14,34 +14,134 @@
 #include <drm/drm_crtc.h>
 #include <drm/drm_gem.h>
 #include <drm/drm_simple_kms_helper.h>
+#include <linux/hashtable.h>
+#include <linux/hrtimer.h>
 #include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/shrinker.h>
+#include <linux/spinlock.h>
+#include <linux/srcu.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <uapi/linux/udrm.h>
 
+struct dma_buf;
+struct dma_buf_attachment;
+struct fence;
 struct miscdevice;
+struct sg_table;
 struct udrm_cdev;
 struct udrm_device;
 
+/* udrm heads */
+
+/*
+ * Frames a controlling process may hold before FLIP_DONE is required. A
+ * completed flip hands the previous fb back to its client, so only the
+ * newest frame may complete while the one before it is still held.
+ */
+#define UDRM_MAX_FLIP_DEPTH 2
+
+/*
+ * Plug state of a head. Snapshots are immutable once published, so
+ * connector callbacks can read them under the device SRCU without taking
+ * the lock of the controlling cdev. Modes are either passed explicitly or
+ * parsed from the EDID once at plug time, probes only copy them.
+ */
+struct udrm_plug {
+	struct edid *edid;
+	unsigned int n_modes;
+	struct drm_display_mode *modes;
+};
+
+struct udrm_plug *udrm_plug_free(struct udrm_plug *plug);
+
+struct udrm_head {
+	struct udrm_device *udrm;
+	unsigned int index;
+	struct drm_simple_display_pipe pipe;
+	struct drm_connector conn;
+
+	/* protected by the event lock of the DRM device */
+	struct drm_pending_vblank_event *flip_event;
+	struct fence *flip_fences[UDRM_MAX_FLIP_DEPTH];
+	unsigned int flip_first;
+	unsigned int n_flips;
+	struct fence *vblank_fence;
+	u32 vblank_fence_seq;
+
+	/* NULL if unplugged, written under the lock of the controlling cdev */
+	struct udrm_plug __rcu *plug;
+
+	spinlock_t fence_lock;
+	u64 fence_context;
+	unsigned int fence_seqno;
+
+	spinlock_t vblank_lock;
+	struct hrtimer vblank_timer;
+	u64 vblank_base_ns;
+	u64 vblank_phase_ns;
+	u64 vblank_mode_ns;
+	u64 vblank_user_ns;
+	u64 vblank_period_ns;
+};
+
+/* udrm bo caches */
+
+struct udrm_bo_cache {
+	spinlock_t lock;
+	struct list_head lru;
+	DECLARE_HASHTABLE(buckets, 6);
+	size_t size;
+	struct shrinker shrinker;
+	bool active : 1;
+};
+
+int udrm_bo_cache_init(struct udrm_bo_cache *cache);
+void udrm_bo_cache_destroy(struct udrm_bo_cache *cache);
+
 /* udrm devices */
 
 struct udrm_device {
 	unsigned long n_bindings;
 	struct device dev;
 	struct drm_device *ddev;
-	struct rw_semaphore cdev_lock;
-	struct udrm_cdev *cdev_unlocked;
-	struct drm_simple_display_pipe pipe;
-	struct drm_connector conn;
+	struct mutex bind_lock;
+	struct srcu_struct cdev_srcu;
+	struct udrm_cdev __rcu *cdev_unlocked;
+	struct drm_property *damage_prop;
+	struct drm_property *in_fence_prop;
+	struct drm_property *out_fence_prop;
+	struct udrm_bo_cache bo_cache;
+	struct delayed_work hotplug_work;
+	struct workqueue_struct *commit_wq;
+	unsigned int n_heads;
+	struct udrm_head *heads;
+	unsigned int n_formats;
+	u32 *formats;
+	unsigned int n_modifiers;
+	u64 *modifiers;
+	u32 min_width;
+	u32 min_height;
+	u32 max_width;
+	u32 max_height;
+	u32 preferred_depth;
 };
 
 struct udrm_device *udrm_device_new(struct device *parent);
 struct udrm_device *udrm_device_ref(struct udrm_device *udrm);
 struct udrm_device *udrm_device_unref(struct udrm_device *udrm);
-struct udrm_cdev *udrm_device_acquire(struct udrm_device *udrm);
+struct udrm_cdev *udrm_device_acquire(struct udrm_device *udrm, int *idx);
 struct udrm_cdev *udrm_device_release(struct udrm_device *udrm,
-				      struct udrm_cdev *cdev);
+				      struct udrm_cdev *cdev,
+				      int idx);
 
 bool udrm_device_is_new(struct udrm_device *udrm);
 bool udrm_device_is_registered(struct udrm_device *udrm);
-int udrm_device_register(struct udrm_device *udrm, struct udrm_cdev *cdev);
+int udrm_device_register(struct udrm_device *udrm,
+			 struct udrm_cdev *cdev,
+			 unsigned int n_heads);
 void udrm_device_unregister(struct udrm_device *udrm);
 
 void udrm_device_hotplug(struct udrm_device *udrm);
@@ -50,10 +150,58 @@ void udrm_device_hotplug(struct udrm_device *udrm);
 
 struct udrm_bo {
 	struct drm_gem_object base;
+	struct mutex lock;
+	struct page **pages;
+	unsigned int n_pins;
+	struct sg_table *sgt;
+	struct dma_buf *export;
+	struct drm_file *access_writer;
+	u32 access_seq;
+	bool cdev_mappable;
+	bool wc;
+	bool prefault;
+
+	/* pages of a write-combined object that were mapped cached */
+	unsigned long *cached_pages;
 };
 
-struct udrm_bo *udrm_bo_new(struct drm_device *ddev, size_t size);
+extern const struct vm_operations_struct udrm_bo_vm_ops;
+
+struct udrm_bo *udrm_bo_new(struct drm_device *ddev,
+			    size_t size,
+			    bool prefault);
 void udrm_bo_free(struct drm_gem_object *dobj);
+struct udrm_bo *udrm_bo_lookup_offset(struct drm_device *ddev,
+				      unsigned long pgoff,
+				      unsigned long n_pages);
+int udrm_bo_mmap(struct udrm_bo *bo, struct vm_area_struct *vma, bool wc);
+int udrm_bo_pin(struct drm_gem_object *dobj);
+void udrm_bo_unpin(struct drm_gem_object *dobj);
+struct sg_table *udrm_bo_get_sg_table(struct drm_gem_object *dobj);
+struct drm_gem_object *
+udrm_bo_import_sg_table(struct drm_device *ddev,
+			struct dma_buf_attachment *attach,
+			struct sg_table *sgt);
+void *udrm_bo_vmap(struct drm_gem_object *dobj);
+void udrm_bo_vunmap(struct drm_gem_object *dobj, void *vaddr);
+int udrm_bo_prime_mmap(struct drm_gem_object *dobj,
+		       struct vm_area_struct *vma);
+struct dma_buf *udrm_bo_export(struct udrm_bo *bo);
+void udrm_bo_close(struct drm_gem_object *dobj, struct drm_file *dfile);
+int udrm_bo_begin_access(struct udrm_bo *bo,
+			 struct drm_file *dfile,
+			 bool write,
+			 u32 *seq);
+int udrm_bo_end_access(struct udrm_bo *bo,
+		       struct drm_file *dfile,
+		       bool write,
+		       u32 *seq);
+int udrm_bo_ioctl_begin_access(struct drm_device *ddev,
+			       void *data,
+			       struct drm_file *dfile);
+int udrm_bo_ioctl_end_access(struct drm_device *ddev,
+			     void *data,
+			     struct drm_file *dfile);
 
 int udrm_dumb_create(struct drm_file *dfile,
 		     struct drm_device *ddev,
@@ -67,24 +215,101 @@ int udrm_dumb_map_offset(struct drm_file *dfile,
 
 struct udrm_fb {
 	struct drm_framebuffer base;
-	struct udrm_bo *bo;
+	struct udrm_bo *bos[UDRM_MAX_PLANES];
+	bool committed;
+};
+
+struct udrm_plane_state {
+	struct drm_plane_state base;
+	struct drm_property_blob *damage;
+};
+
+#define to_udrm_plane_state(_state) \
+	container_of(_state, struct udrm_plane_state, base)
+
+struct udrm_crtc_state {
+	struct drm_crtc_state base;
+	s32 __user *out_fence_ptr;
+	struct fence *out_fence;
 };
 
-struct udrm_fb *udrm_fb_new(struct udrm_bo *bo,
+#define to_udrm_crtc_state(_state) \
+	container_of(_state, struct udrm_crtc_state, base)
+
+struct udrm_fb *udrm_fb_new(struct drm_device *ddev,
+			    struct udrm_bo **bos,
 			    const struct drm_mode_fb_cmd2 *cmd);
+struct udrm_fb *udrm_fb_lookup(struct udrm_device *udrm, u32 id);
 
+bool udrm_kms_format_is_known(u32 format);
 int udrm_kms_bind(struct udrm_device *udrm);
 void udrm_kms_unbind(struct udrm_device *udrm);
+bool udrm_kms_flip_done(struct udrm_head *head);
+void udrm_kms_flip_done_all(struct udrm_head *head);
+int udrm_kms_parse_plug(struct udrm_head *head, struct udrm_plug *plug);
+void udrm_kms_update_edid(struct udrm_head *head, struct edid *edid);
+void udrm_kms_set_vblank(struct udrm_head *head,
+			 u64 period_ns,
+			 u64 phase_ns);
+enum hrtimer_restart udrm_kms_vblank_fn(struct hrtimer *timer);
+int udrm_kms_enable_vblank(struct drm_device *ddev, unsigned int pipe);
+void udrm_kms_disable_vblank(struct drm_device *ddev, unsigned int pipe);
 
 /* udrm cdevs */
 
+struct udrm_cdev_event {
+	struct list_head link;
+	size_t size;
+	union {
+		struct udrm_event base;
+		struct udrm_event_fb_commit fb_commit;
+		struct udrm_event_pipe_enable pipe_enable;
+		struct udrm_event_pipe_disable pipe_disable;
+		struct udrm_event_dirty dirty;
+	} ev;
+};
+
+/* latest-frame slot of a head, for cdevs registered with MAILBOX */
+struct udrm_mailbox {
+	struct udrm_cdev_event *commit;
+	u64 seq;
+	u64 n_dropped;
+};
+
 struct udrm_cdev {
 	struct mutex lock;
 	struct udrm_device *udrm;
-	struct edid *edid;
-	bool plugged : 1;
+	u64 flags;
+	unsigned int flip_depth;
+
+	struct mutex read_lock;
+	wait_queue_head_t waitq;
+	spinlock_t event_lock;
+	struct list_head event_list;
+	struct udrm_cdev_event *dirty;
+	size_t event_space;
+	u64 n_dropped;
+	unsigned int max_clips;
+	struct udrm_mailbox *mailboxes;
+	unsigned int n_mailboxes;
+	u32 frames_ready;
 };
 
 extern struct miscdevice udrm_cdev_misc;
 
+struct udrm_cdev_event *udrm_cdev_event_new(u32 type, size_t size);
+void udrm_cdev_queue(struct udrm_cdev *cdev, struct udrm_cdev_event *event);
+void udrm_cdev_queue_commit(struct udrm_cdev *cdev,
+			    struct drm_framebuffer *dfb,
+			    struct udrm_cdev_event *event);
+void udrm_clips_merge(struct drm_clip_rect *set,
+		      u32 *n_set,
+		      unsigned int max_clips,
+		      struct drm_framebuffer *dfb,
+		      const struct drm_clip_rect *clip);
+void udrm_cdev_queue_dirty(struct udrm_cdev *cdev,
+			   struct drm_framebuffer *dfb,
+			   const struct drm_clip_rect *clips,
+			   unsigned int n_clips);
+
 #endif /* __UDRM_UDRM_H */
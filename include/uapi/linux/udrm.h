@@ -10,26 +10,239 @@
  * option) any later version.
  */
 
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
 #include <linux/ioctl.h>
 #include <linux/types.h>
 
 #define UDRM_IOCTL_MAGIC		0x99
 
+/* entries of the FB_DAMAGE_CLIPS plane property, in framebuffer coordinates */
+struct udrm_damage_rect {
+	__s32 x1;
+	__s32 y1;
+	__s32 x2;
+	__s32 y2;
+};
+
+enum {
+	UDRM_REGISTER_FLIP_ACK		= 1ULL << 0,
+	UDRM_REGISTER_MAILBOX		= 1ULL << 1,
+};
+
+struct udrm_cmd_register {
+	__u64 flags;
+	__u32 max_clips;
+	__u32 n_heads;
+	__u32 n_formats;
+	__u32 n_modifiers;
+	__u64 ptr_formats;
+	__u64 ptr_modifiers;
+	__u32 min_width;
+	__u32 min_height;
+	__u32 max_width;
+	__u32 max_height;
+	__u32 preferred_depth;
+	__u32 flip_depth;
+} __attribute__((__aligned__(8)));
+
+enum {
+	UDRM_PLUG_REPLACE		= 1ULL << 0,
+};
+
+/*
+ * Fields past @ptr_edid were appended later; PLUG with the size of the
+ * original struct is still accepted, and leaves them zero.
+ */
 struct udrm_cmd_plug {
 	__u64 flags;
 	__u64 n_edid;
 	__u64 ptr_edid;
+	__u32 head;
+	__u32 n_modes;
+	__u32 preferred_mode;
+	__u32 __pad;
+	__u64 ptr_modes;
+} __attribute__((__aligned__(8)));
+
+#define UDRM_MAX_PLANES			4
+
+enum {
+	UDRM_MAP_DMABUF			= 1ULL << 0,
+};
+
+struct udrm_cmd_map_plane {
+	__u32 pitch;
+	__u32 data_offset;
+	__u64 size;
+	__u64 map_offset;
+	__u64 modifier;
+	__s32 dmabuf_fd;
+	__u32 __pad;
+} __attribute__((__aligned__(8)));
+
+struct udrm_cmd_map {
+	__u64 flags;
+	__u32 fb_id;
+	__u32 format;
+	__u32 width;
+	__u32 height;
+	__u32 n_planes;
+	__u32 __pad;
+	struct udrm_cmd_map_plane planes[UDRM_MAX_PLANES];
+} __attribute__((__aligned__(8)));
+
+struct udrm_cmd_vblank {
+	__u64 flags;
+	__u32 head;
+	__u32 __pad;
+	__u64 period_ns;
+	__u64 phase_ns;
+} __attribute__((__aligned__(8)));
+
+enum {
+	UDRM_SUBMIT_STOP_ON_ERROR	= 1ULL << 0,
+};
+
+struct udrm_submit_entry {
+	__u32 cmd;
+	__s32 result;
+	__u64 arg;
+} __attribute__((__aligned__(8)));
+
+struct udrm_cmd_submit {
+	__u64 flags;
+	__u64 n_entries;
+	__u64 ptr_entries;
+} __attribute__((__aligned__(8)));
+
+struct udrm_event {
+	__u32 type;
+	__u32 length;
+};
+
+struct udrm_event_overflow {
+	struct udrm_event base;
+	__u64 n_dropped;
+};
+
+struct udrm_event_fb_commit {
+	struct udrm_event base;
+	__u32 head;
+	__u32 fb_id;
+	__u32 n_clips;
+	__u32 __pad;
+	struct drm_clip_rect clips[];
+};
+
+struct udrm_event_pipe_enable {
+	struct udrm_event base;
+	__u32 head;
+	__u32 __pad;
+	struct drm_mode_modeinfo mode;
+};
+
+struct udrm_event_pipe_disable {
+	struct udrm_event base;
+	__u32 head;
+	__u32 __pad;
+};
+
+struct udrm_event_dirty {
+	struct udrm_event base;
+	__u32 fb_id;
+	__u32 n_clips;
+	struct drm_clip_rect clips[];
+};
+
+/*
+ * Claims the latest frame of a head, for cdevs registered with MAILBOX.
+ * The cdev polls POLLPRI while any head has a frame to claim.
+ * @n_clips is the capacity of @ptr_clips on input, and the number of damage
+ * clips of the frame on output; damage that does not fit is reported as
+ * its bounding box. With a capacity of 0, no clips are copied, so any
+ * damage has to be taken as covering the whole frame.
+ */
+struct udrm_cmd_grab {
+	__u64 flags;
+	__u32 head;
+	__u32 fb_id;
+	__u64 seq;
+	__u64 n_dropped;
+	__u32 n_clips;
+	__u32 __pad;
+	__u64 ptr_clips;
 } __attribute__((__aligned__(8)));
 
+/*
+ * Flags of DRM_IOCTL_MODE_CREATE_DUMB on udrm DRM nodes. WRITECOMBINE is
+ * only honoured on x86, elsewhere the object is mapped cached.
+ */
+enum {
+	UDRM_DUMB_WRITECOMBINE		= 1ULL << 0,
+	UDRM_DUMB_PREFAULT		= 1ULL << 1,
+};
+
+enum {
+	UDRM_ACCESS_WRITE		= 1ULL << 0,
+};
+
+/*
+ * Brackets CPU access to a buffer object. On DRM nodes @id is a GEM handle
+ * and @plane must be 0, on the cdev they select a plane of a framebuffer
+ * and only reads are allowed. BEGIN returns @seq, which END of a read
+ * checks to tell whether a write raced with it.
+ */
+struct udrm_cmd_access {
+	__u64 flags;
+	__u32 id;
+	__u32 plane;
+	__u32 seq;
+	__u32 __pad;
+} __attribute__((__aligned__(8)));
+
+enum {
+	UDRM_EVENT_OVERFLOW,
+	UDRM_EVENT_FB_COMMIT,
+	UDRM_EVENT_PIPE_ENABLE,
+	UDRM_EVENT_PIPE_DISABLE,
+	UDRM_EVENT_DIRTY,
+};
+
 enum {
 	UDRM_CMD_REGISTER		= _IOWR(UDRM_IOCTL_MAGIC, 0x00,
-					__u64),
+					struct udrm_cmd_register),
 	UDRM_CMD_UNREGISTER		= _IOWR(UDRM_IOCTL_MAGIC, 0x01,
 					__u64),
 	UDRM_CMD_PLUG			= _IOWR(UDRM_IOCTL_MAGIC, 0x02,
 					struct udrm_cmd_plug),
 	UDRM_CMD_UNPLUG			= _IOWR(UDRM_IOCTL_MAGIC, 0x03,
 					__u64),
+	UDRM_CMD_MAP			= _IOWR(UDRM_IOCTL_MAGIC, 0x04,
+					struct udrm_cmd_map),
+	UDRM_CMD_FLIP_DONE		= _IOWR(UDRM_IOCTL_MAGIC, 0x05,
+					__u64),
+	UDRM_CMD_VBLANK			= _IOWR(UDRM_IOCTL_MAGIC, 0x06,
+					struct udrm_cmd_vblank),
+	UDRM_CMD_SUBMIT			= _IOWR(UDRM_IOCTL_MAGIC, 0x07,
+					struct udrm_cmd_submit),
+	UDRM_CMD_BEGIN_ACCESS		= _IOWR(UDRM_IOCTL_MAGIC, 0x08,
+					struct udrm_cmd_access),
+	UDRM_CMD_END_ACCESS		= _IOWR(UDRM_IOCTL_MAGIC, 0x09,
+					struct udrm_cmd_access),
+	UDRM_CMD_GRAB			= _IOWR(UDRM_IOCTL_MAGIC, 0x0a,
+					struct udrm_cmd_grab),
 };
 
+/* driver-private ioctls of udrm DRM nodes */
+#define DRM_UDRM_BEGIN_ACCESS		0x00
+#define DRM_UDRM_END_ACCESS		0x01
+
+#define DRM_IOCTL_UDRM_BEGIN_ACCESS	DRM_IOWR(DRM_COMMAND_BASE + \
+					DRM_UDRM_BEGIN_ACCESS, \
+					struct udrm_cmd_access)
+#define DRM_IOCTL_UDRM_END_ACCESS	DRM_IOWR(DRM_COMMAND_BASE + \
+					DRM_UDRM_END_ACCESS, \
+					struct udrm_cmd_access)
+
 #endif /* _UAPI_LINUX_UDRM_H */
@@ -8,10 +8,21 @@
  */
 
 #define _GNU_SOURCE
+#include <drm/drm_fourcc.h>
+#include <linux/netlink.h>
 #include <video/edid.h>
 #include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/sysmacros.h>
 #include "test.h"
 
+/* REGISTER as issued by binaries built before it took parameters */
+#define TEST_CMD_REGISTER_V0 _IOWR(UDRM_IOCTL_MAGIC, 0x00, __u64)
+
+/* PLUG as issued by binaries built before @head was appended */
+#define TEST_CMD_PLUG_V0 _IOC(_IOC_READ | _IOC_WRITE, UDRM_IOCTL_MAGIC, 0x02, \
+			      offsetof(struct udrm_cmd_plug, head))
+
 static const uint8_t valid_edid[128] = {
 	0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00,
 	0x31, 0xd8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
@@ -50,6 +61,169 @@ static const uint8_t invalid_edid[128] = { /* cleared first byte after header */
 	0x56, 0x47, 0x41, 0x0a, 0x20, 0x20, 0x00, 0xc2,
 };
 
+/* open the DRM node of the only registered udrm device */
+static int test_open_card(void)
+{
+	struct drm_version version;
+	char path[32], name[8];
+	int i, fd;
+
+	for (i = 0; i < 64; ++i) {
+		sprintf(path, "/dev/dri/card%d", i);
+		fd = open(path, O_RDWR | O_CLOEXEC | O_NOCTTY);
+		if (fd < 0)
+			continue;
+
+		memset(&version, 0, sizeof(version));
+		memset(name, 0, sizeof(name));
+		version.name = name;
+		version.name_len = sizeof(name) - 1;
+		if (ioctl(fd, DRM_IOCTL_VERSION, &version) >= 0 &&
+		    !strcmp(name, "udrm"))
+			return fd;
+
+		close(fd);
+	}
+
+	return -1;
+}
+
+/* look up a property of a DRM object by name, 0 if there is none */
+static uint32_t test_find_prop(int card,
+			       uint32_t obj_id,
+			       uint32_t obj_type,
+			       const char *name)
+{
+	struct drm_mode_obj_get_properties props = {};
+	struct drm_mode_get_property prop;
+	uint64_t values[64];
+	uint32_t ids[64];
+	uint32_t i;
+	int r;
+
+	props.obj_id = obj_id;
+	props.obj_type = obj_type;
+	props.count_props = 64;
+	props.props_ptr = (uintptr_t)ids;
+	props.prop_values_ptr = (uintptr_t)values;
+	r = ioctl(card, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &props);
+	assert(r >= 0 && props.count_props <= 64);
+
+	for (i = 0; i < props.count_props; ++i) {
+		memset(&prop, 0, sizeof(prop));
+		prop.prop_id = ids[i];
+		r = ioctl(card, DRM_IOCTL_MODE_GETPROPERTY, &prop);
+		assert(r >= 0);
+		if (!strcmp(prop.name, name))
+			return ids[i];
+	}
+
+	return 0;
+}
+
+static const struct drm_mode_modeinfo test_mode = {
+	.clock = 65000,
+	.hdisplay = 1024,
+	.hsync_start = 1048,
+	.hsync_end = 1184,
+	.htotal = 1344,
+	.vdisplay = 768,
+	.vsync_start = 771,
+	.vsync_end = 777,
+	.vtotal = 806,
+	.vrefresh = 60,
+	.name = "1024x768",
+};
+
+/* create a dumb buffer the size of test_mode and wrap it in a fb */
+static uint32_t test_add_fb(int card, uint32_t *handle)
+{
+	struct drm_mode_create_dumb create = {};
+	struct drm_mode_fb_cmd2 fb = {};
+	int r;
+
+	create.width = test_mode.hdisplay;
+	create.height = test_mode.vdisplay;
+	create.bpp = 32;
+	r = ioctl(card, DRM_IOCTL_MODE_CREATE_DUMB, &create);
+	assert(r >= 0);
+
+	fb.width = create.width;
+	fb.height = create.height;
+	fb.pixel_format = DRM_FORMAT_XRGB8888;
+	fb.handles[0] = create.handle;
+	fb.pitches[0] = create.pitch;
+	r = ioctl(card, DRM_IOCTL_MODE_ADDFB2, &fb);
+	assert(r >= 0);
+
+	if (handle)
+		*handle = create.handle;
+	return fb.fb_id;
+}
+
+/* plug the only head with test_mode and scan out @fb, returns the crtc */
+static uint32_t test_modeset(int fd, int card, uint32_t fb)
+{
+	struct drm_mode_card_res res = {};
+	struct udrm_cmd_plug plug = {};
+	struct drm_mode_crtc crtc = {};
+	uint32_t conn;
+	int r;
+
+	plug.n_modes = 1;
+	plug.ptr_modes = (uintptr_t)&test_mode;
+	r = ioctl(fd, UDRM_CMD_PLUG, &plug);
+	assert(r >= 0);
+
+	res.count_crtcs = 1;
+	res.crtc_id_ptr = (uintptr_t)&crtc.crtc_id;
+	res.count_connectors = 1;
+	res.connector_id_ptr = (uintptr_t)&conn;
+	r = ioctl(card, DRM_IOCTL_MODE_GETRESOURCES, &res);
+	assert(r >= 0 && res.count_crtcs == 1 && res.count_connectors == 1);
+
+	crtc.set_connectors_ptr = (uintptr_t)&conn;
+	crtc.count_connectors = 1;
+	crtc.fb_id = fb;
+	crtc.mode_valid = 1;
+	crtc.mode = test_mode;
+	r = ioctl(card, DRM_IOCTL_MODE_SETCRTC, &crtc);
+	assert(r >= 0);
+
+	return crtc.crtc_id;
+}
+
+/* page flip with an event, once the previous commit is out of the way */
+static int test_page_flip(int card, uint32_t crtc, uint32_t fb)
+{
+	struct drm_mode_crtc_page_flip flip = {};
+	int r, i;
+
+	flip.crtc_id = crtc;
+	flip.fb_id = fb;
+	flip.flags = DRM_MODE_PAGE_FLIP_EVENT;
+
+	for (i = 0; i < 100; ++i) {
+		r = ioctl(card, DRM_IOCTL_MODE_PAGE_FLIP, &flip);
+		if (r >= 0 || errno != EBUSY)
+			break;
+		usleep(1000);
+	}
+
+	return r;
+}
+
+/* wait up to @timeout ms for @events, returns the events that arrived */
+static short test_poll(int fd, short events, int timeout)
+{
+	struct pollfd pfd = { .fd = fd, .events = events };
+	int r;
+
+	r = poll(&pfd, 1, timeout);
+	assert(r >= 0);
+	return r ? pfd.revents : 0;
+}
+
 /* make sure /dev/udrm exists, is a cdev and accessible */
 static void test_api_cdev(void)
 {
@@ -72,6 +246,7 @@ static void test_api_cdev(void)
 /* make sure simple REGISTER/UNREGISTER works */
 static void test_api_registration(void)
 {
+	struct udrm_cmd_register reg = {};
 	int r, fd;
 
 	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
@@ -80,7 +255,33 @@ static void test_api_registration(void)
 	r = ioctl(fd, UDRM_CMD_UNREGISTER, NULL);
 	assert(r < 0 && errno == ENOTCONN);
 
-	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
+	reg.flags = 1;
+	r = ioctl(fd, UDRM_CMD_REGISTER, &reg);
+	assert(r < 0 && errno == EINVAL);
+
+	reg.flags = 0;
+	reg.max_clips = 1 << 16;
+	r = ioctl(fd, UDRM_CMD_REGISTER, &reg);
+	assert(r < 0 && errno == EINVAL);
+
+	reg.max_clips = 0;
+	reg.max_width = 1 << 20;
+	r = ioctl(fd, UDRM_CMD_REGISTER, &reg);
+	assert(r < 0 && errno == EINVAL);
+
+	reg.max_width = 64;
+	r = ioctl(fd, UDRM_CMD_REGISTER, &reg);
+	assert(r < 0 && errno == EINVAL);
+
+	reg.max_width = 0;
+	reg.preferred_depth = 7;
+	r = ioctl(fd, UDRM_CMD_REGISTER, &reg);
+	assert(r < 0 && errno == EINVAL);
+
+	r = ioctl(fd, TEST_CMD_REGISTER_V0, &reg);
+	assert(r < 0 && errno == EINVAL);
+
+	r = ioctl(fd, TEST_CMD_REGISTER_V0, NULL);
 	assert(r >= 0);
 
 	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
@@ -138,6 +339,1136 @@ static void test_api_plugging(void)
 	r = ioctl(fd, UDRM_CMD_PLUG, &plug);
 	assert(r >= 0);
 
+	r = ioctl(fd, UDRM_CMD_UNPLUG, NULL);
+	assert(r >= 0);
+
+	/* the old layout ends before @head, so this still plugs head 0 */
+	plug.head = 1;
+	r = ioctl(fd, TEST_CMD_PLUG_V0, &plug);
+	assert(r >= 0);
+
+	close(fd);
+}
+
+/* make sure PLUG accepts explicit mode lists */
+static void test_api_plug_modes(void)
+{
+	struct drm_mode_modeinfo modes[2] = {
+		{
+			.clock = 552750,
+			.hdisplay = 2560,
+			.hsync_start = 2608,
+			.hsync_end = 2640,
+			.htotal = 2720,
+			.vdisplay = 1600,
+			.vsync_start = 1603,
+			.vsync_end = 1609,
+			.vtotal = 1694,
+			.vrefresh = 120,
+			.name = "2560x1600",
+		},
+		{
+			.clock = 65000,
+			.hdisplay = 1024,
+			.hsync_start = 1048,
+			.hsync_end = 1184,
+			.htotal = 1344,
+			.vdisplay = 768,
+			.vsync_start = 771,
+			.vsync_end = 777,
+			.vtotal = 806,
+			.vrefresh = 60,
+			.name = "1024x768",
+		},
+	};
+	struct udrm_cmd_plug plug = {};
+	int r, fd;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
+	assert(r >= 0);
+
+	plug.ptr_modes = (uintptr_t)modes;
+	plug.n_modes = 2;
+	plug.preferred_mode = 2;
+	r = ioctl(fd, UDRM_CMD_PLUG, &plug);
+	assert(r < 0 && errno == EINVAL);
+
+	modes[1].hdisplay = 0;
+	plug.preferred_mode = 0;
+	r = ioctl(fd, UDRM_CMD_PLUG, &plug);
+	assert(r < 0 && errno == EINVAL);
+
+	modes[1].hdisplay = 1024;
+	r = ioctl(fd, UDRM_CMD_PLUG, &plug);
+	assert(r >= 0);
+
+	r = ioctl(fd, UDRM_CMD_UNPLUG, NULL);
+	assert(r >= 0);
+
+	plug.ptr_edid = (uintptr_t)valid_edid;
+	plug.n_edid = sizeof(valid_edid);
+	r = ioctl(fd, UDRM_CMD_PLUG, &plug);
+	assert(r >= 0);
+
+	r = ioctl(fd, UDRM_CMD_PLUG, &plug);
+	assert(r < 0 && errno == EALREADY);
+
+	plug.flags = UDRM_PLUG_REPLACE;
+	plug.n_modes = 1;
+	r = ioctl(fd, UDRM_CMD_PLUG, &plug);
+	assert(r >= 0);
+
+	r = ioctl(fd, UDRM_CMD_UNPLUG, NULL);
+	assert(r >= 0);
+
+	r = ioctl(fd, UDRM_CMD_PLUG, &plug);
+	assert(r >= 0);
+
+	close(fd);
+}
+
+/* make sure MAP and mmap reject unknown framebuffers */
+static void test_api_mapping(void)
+{
+	struct udrm_cmd_map map = {};
+	void *p;
+	int r, fd;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_MAP, &map);
+	assert(r < 0 && errno == ENOTCONN);
+
+	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
+	assert(r >= 0);
+
+	map.flags = UDRM_MAP_DMABUF << 1;
+	r = ioctl(fd, UDRM_CMD_MAP, &map);
+	assert(r < 0 && errno == EINVAL);
+
+	map.flags = 0;
+	r = ioctl(fd, UDRM_CMD_MAP, &map);
+	assert(r < 0 && errno == ENOENT);
+
+	map.flags = UDRM_MAP_DMABUF;
+	r = ioctl(fd, UDRM_CMD_MAP, &map);
+	assert(r < 0 && errno == ENOENT);
+
+	p = mmap(NULL, 4096, PROT_READ, MAP_SHARED, fd, 0);
+	assert(p == MAP_FAILED && errno == EINVAL);
+
+	p = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	assert(p == MAP_FAILED && errno == EPERM);
+
+	close(fd);
+}
+
+/* make sure imported objects are not handed out as dma-bufs */
+static void test_api_map_import(void)
+{
+	struct drm_prime_handle prime = {};
+	struct drm_mode_fb_cmd2 fb = {};
+	struct udrm_cmd_map map = {};
+	uint32_t crtc;
+	void *p;
+	int r, fd, card;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
+	assert(r >= 0);
+
+	card = test_open_card();
+	assert(card >= 0);
+
+	map.fb_id = test_add_fb(card, NULL);
+	crtc = test_modeset(fd, card, map.fb_id);
+
+	map.flags = UDRM_MAP_DMABUF;
+	r = ioctl(fd, UDRM_CMD_MAP, &map);
+	assert(r >= 0 && map.n_planes == 1);
+	assert(map.planes[0].dmabuf_fd >= 0);
+
+	p = mmap(NULL, map.planes[0].size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		 map.planes[0].dmabuf_fd, 0);
+	assert(p == MAP_FAILED && errno == EACCES);
+
+	p = mmap(NULL, map.planes[0].size, PROT_READ, MAP_SHARED,
+		 map.planes[0].dmabuf_fd, 0);
+	assert(p != MAP_FAILED);
+	munmap(p, map.planes[0].size);
+
+	/* a udrm dma-buf is foreign to the DRM node, so this imports it */
+	prime.fd = map.planes[0].dmabuf_fd;
+	r = ioctl(card, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime);
+	assert(r >= 0);
+	close(prime.fd);
+
+	fb.width = map.width;
+	fb.height = map.height;
+	fb.pixel_format = map.format;
+	fb.handles[0] = prime.handle;
+	fb.pitches[0] = map.planes[0].pitch;
+	r = ioctl(card, DRM_IOCTL_MODE_ADDFB2, &fb);
+	assert(r >= 0);
+
+	r = test_page_flip(card, crtc, fb.fb_id);
+	assert(r >= 0);
+	assert(test_poll(card, POLLIN, 1000) & POLLIN);
+
+	map.fb_id = fb.fb_id;
+	r = ioctl(fd, UDRM_CMD_MAP, &map);
+	assert(r < 0 && errno == EPERM);
+
+	map.flags = 0;
+	r = ioctl(fd, UDRM_CMD_MAP, &map);
+	assert(r >= 0);
+
+	close(card);
+	close(fd);
+}
+
+/* make sure freed buffers are handed out again only after a scrub */
+static void test_api_bo_cache(void)
+{
+	struct drm_mode_create_dumb create = {};
+	struct drm_mode_destroy_dumb destroy = {};
+	struct drm_mode_map_dumb map = {};
+	uint8_t *p;
+	size_t i;
+	int r, fd, card;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
+	assert(r >= 0);
+
+	card = test_open_card();
+	assert(card >= 0);
+
+	create.width = 64;
+	create.height = 64;
+	create.bpp = 32;
+	r = ioctl(card, DRM_IOCTL_MODE_CREATE_DUMB, &create);
+	assert(r >= 0);
+
+	map.handle = create.handle;
+	r = ioctl(card, DRM_IOCTL_MODE_MAP_DUMB, &map);
+	assert(r >= 0);
+
+	p = mmap(NULL, create.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		 card, map.offset);
+	assert(p != MAP_FAILED);
+	memset(p, 0xa5, create.size);
+	munmap(p, create.size);
+
+	destroy.handle = create.handle;
+	r = ioctl(card, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	assert(r >= 0);
+
+	/* same size, so this recycles the shmem file if the cache is on */
+	r = ioctl(card, DRM_IOCTL_MODE_CREATE_DUMB, &create);
+	assert(r >= 0);
+
+	map.handle = create.handle;
+	r = ioctl(card, DRM_IOCTL_MODE_MAP_DUMB, &map);
+	assert(r >= 0);
+
+	p = mmap(NULL, create.size, PROT_READ, MAP_SHARED, card, map.offset);
+	assert(p != MAP_FAILED);
+	for (i = 0; i < create.size; ++i)
+		assert(p[i] == 0);
+
+	munmap(p, create.size);
+	close(card);
+	close(fd);
+}
+
+/* make sure PRIME export and import round-trip on the DRM node */
+static void test_api_prime(void)
+{
+	struct drm_mode_create_dumb create = {};
+	struct drm_prime_handle prime = {};
+	struct drm_mode_map_dumb map = {};
+	uint8_t *p, *q;
+	int r, fd, card;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
+	assert(r >= 0);
+
+	card = test_open_card();
+	assert(card >= 0);
+
+	create.width = 64;
+	create.height = 64;
+	create.bpp = 32;
+	r = ioctl(card, DRM_IOCTL_MODE_CREATE_DUMB, &create);
+	assert(r >= 0);
+
+	prime.handle = create.handle;
+	prime.flags = DRM_CLOEXEC | DRM_RDWR;
+	r = ioctl(card, DRM_IOCTL_PRIME_HANDLE_TO_FD, &prime);
+	assert(r >= 0 && prime.fd >= 0);
+
+	/* importing our own dma-buf yields the original object */
+	prime.handle = 0;
+	r = ioctl(card, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime);
+	assert(r >= 0 && prime.handle == create.handle);
+
+	map.handle = create.handle;
+	r = ioctl(card, DRM_IOCTL_MODE_MAP_DUMB, &map);
+	assert(r >= 0);
+
+	p = mmap(NULL, create.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		 card, map.offset);
+	assert(p != MAP_FAILED);
+
+	q = mmap(NULL, create.size, PROT_READ, MAP_SHARED, prime.fd, 0);
+	assert(q != MAP_FAILED);
+
+	memset(p, 0x5a, create.size);
+	assert(q[0] == 0x5a && q[create.size - 1] == 0x5a);
+
+	munmap(q, create.size);
+	munmap(p, create.size);
+	close(prime.fd);
+	close(card);
+	close(fd);
+}
+
+/* make sure multi-planar fbs are accepted and mapped plane by plane */
+static void test_api_planar(void)
+{
+	uint32_t formats[] = { DRM_FORMAT_XRGB8888, DRM_FORMAT_NV12 };
+	struct drm_mode_create_dumb create[2] = {};
+	struct udrm_cmd_register reg = {};
+	struct drm_mode_fb_cmd2 fb = {};
+	struct udrm_cmd_map map = {};
+	int r, fd, card;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	reg.n_formats = sizeof(formats) / sizeof(*formats);
+	reg.ptr_formats = (uintptr_t)formats;
+	r = ioctl(fd, UDRM_CMD_REGISTER, &reg);
+	assert(r >= 0);
+
+	card = test_open_card();
+	assert(card >= 0);
+
+	/* luma, and interleaved chroma subsampled in both directions */
+	create[0].width = test_mode.hdisplay;
+	create[0].height = test_mode.vdisplay;
+	create[0].bpp = 8;
+	r = ioctl(card, DRM_IOCTL_MODE_CREATE_DUMB, &create[0]);
+	assert(r >= 0);
+
+	create[1].width = test_mode.hdisplay;
+	create[1].height = test_mode.vdisplay / 2;
+	create[1].bpp = 8;
+	r = ioctl(card, DRM_IOCTL_MODE_CREATE_DUMB, &create[1]);
+	assert(r >= 0);
+
+	fb.width = test_mode.hdisplay;
+	fb.height = test_mode.vdisplay;
+	fb.pixel_format = DRM_FORMAT_NV12;
+	fb.handles[0] = create[0].handle;
+	fb.pitches[0] = create[0].pitch;
+	fb.pitches[1] = create[1].pitch;
+	r = ioctl(card, DRM_IOCTL_MODE_ADDFB2, &fb);
+	assert(r < 0 && errno == EINVAL);
+
+	fb.handles[1] = create[1].handle;
+	r = ioctl(card, DRM_IOCTL_MODE_ADDFB2, &fb);
+	assert(r >= 0);
+
+	test_modeset(fd, card, fb.fb_id);
+
+	map.fb_id = fb.fb_id;
+	r = ioctl(fd, UDRM_CMD_MAP, &map);
+	assert(r >= 0);
+	assert(map.format == DRM_FORMAT_NV12 && map.n_planes == 2);
+	assert(map.planes[0].size == create[0].size);
+	assert(map.planes[1].size == create[1].size);
+	assert(map.planes[0].map_offset != map.planes[1].map_offset);
+
+	close(card);
+	close(fd);
+}
+
+/* make sure probes report the modes of the plug, and only while plugged */
+static void test_api_probe(void)
+{
+	struct drm_mode_get_connector get = {};
+	struct drm_mode_card_res res = {};
+	struct udrm_cmd_plug plug = {};
+	uint32_t conn, n_modes;
+	int r, i, fd, card;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
+	assert(r >= 0);
+
+	card = test_open_card();
+	assert(card >= 0);
+
+	res.count_connectors = 1;
+	res.connector_id_ptr = (uintptr_t)&conn;
+	r = ioctl(card, DRM_IOCTL_MODE_GETRESOURCES, &res);
+	assert(r >= 0 && res.count_connectors == 1);
+
+	get.connector_id = conn;
+	r = ioctl(card, DRM_IOCTL_MODE_GETCONNECTOR, &get);
+	assert(r >= 0);
+	assert(get.connection == 2 && get.count_modes == 0);
+
+	plug.ptr_edid = (uintptr_t)valid_edid;
+	plug.n_edid = sizeof(valid_edid);
+	r = ioctl(fd, UDRM_CMD_PLUG, &plug);
+	assert(r >= 0);
+
+	/* the EDID is parsed once, so every probe sees the same modes */
+	memset(&get, 0, sizeof(get));
+	get.connector_id = conn;
+	r = ioctl(card, DRM_IOCTL_MODE_GETCONNECTOR, &get);
+	assert(r >= 0);
+	assert(get.connection == 1 && get.count_modes > 0);
+	n_modes = get.count_modes;
+
+	for (i = 0; i < 16; ++i) {
+		memset(&get, 0, sizeof(get));
+		get.connector_id = conn;
+		r = ioctl(card, DRM_IOCTL_MODE_GETCONNECTOR, &get);
+		assert(r >= 0 && get.count_modes == n_modes);
+	}
+
+	r = ioctl(fd, UDRM_CMD_UNPLUG, NULL);
+	assert(r >= 0);
+
+	memset(&get, 0, sizeof(get));
+	get.connector_id = conn;
+	r = ioctl(card, DRM_IOCTL_MODE_GETCONNECTOR, &get);
+	assert(r >= 0);
+	assert(get.connection == 2 && get.count_modes == 0);
+
+	close(card);
+	close(fd);
+}
+
+/* make sure the DRM node can be opened from many processes at once */
+static void test_api_open(void)
+{
+	pid_t pids[4];
+	int r, i, j, fd, card;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
+	assert(r >= 0);
+
+	for (i = 0; i < 4; ++i) {
+		pids[i] = fork();
+		assert(pids[i] >= 0);
+		if (pids[i])
+			continue;
+
+		for (j = 0; j < 64; ++j) {
+			card = test_open_card();
+			if (card < 0)
+				_exit(1);
+			close(card);
+		}
+		_exit(0);
+	}
+
+	for (i = 0; i < 4; ++i) {
+		r = waitpid(pids[i], &j, 0);
+		assert(r == pids[i]);
+		assert(WIFEXITED(j) && WEXITSTATUS(j) == 0);
+	}
+
+	close(fd);
+}
+
+/* count change events of @card that carry HOTPLUG=1 */
+static int test_count_hotplugs(int nl, int card)
+{
+	char buf[4096], suffix[32];
+	struct stat st;
+	size_t i, n;
+	ssize_t l;
+	int r, n_events = 0;
+
+	r = fstat(card, &st);
+	assert(r >= 0);
+	n = sprintf(suffix, "/card%u", minor(st.st_rdev));
+
+	while ((l = recv(nl, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[l] = 0;
+		i = strlen(buf);
+		if (i < n || strcmp(buf + i - n, suffix))
+			continue;
+
+		for (; i < (size_t)l; i += strlen(buf + i) + 1)
+			if (!strcmp(buf + i, "HOTPLUG=1"))
+				++n_events;
+	}
+
+	return n_events;
+}
+
+/* make sure bursts of plug changes are merged into one hotplug event */
+static void test_api_hotplug(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1,
+	};
+	struct udrm_cmd_plug plug = {};
+	char delay[16] = {};
+	ssize_t l;
+	int r, i, fd, nl, card, param;
+
+	/* the window is a module parameter, only root may change it */
+	param = open("/sys/module/udrm/parameters/hotplug_delay_ms",
+		     O_RDWR | O_CLOEXEC);
+	if (param < 0)
+		return;
+
+	l = read(param, delay, sizeof(delay) - 1);
+	assert(l > 0);
+
+	l = pwrite(param, "100", 3, 0);
+	assert(l == 3);
+
+	nl = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+		    NETLINK_KOBJECT_UEVENT);
+	assert(nl >= 0);
+
+	r = bind(nl, (struct sockaddr *)&addr, sizeof(addr));
+	assert(r >= 0);
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
+	assert(r >= 0);
+
+	card = test_open_card();
+	assert(card >= 0);
+
+	for (i = 0; i < 16; ++i) {
+		r = ioctl(fd, UDRM_CMD_PLUG, &plug);
+		assert(r >= 0);
+		r = ioctl(fd, UDRM_CMD_UNPLUG, NULL);
+		assert(r >= 0);
+	}
+
+	usleep(300 * 1000);
+	r = test_count_hotplugs(nl, card);
+	assert(r >= 1 && r <= 2);
+
+	l = pwrite(param, delay, strlen(delay), 0);
+	assert(l > 0);
+
+	close(card);
+	close(fd);
+	close(nl);
+	close(param);
+}
+
+/* make sure CPU access brackets are read-only and reject unknown fbs */
+static void test_api_access(void)
+{
+	struct udrm_cmd_access access = {};
+	int r, fd;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_BEGIN_ACCESS, &access);
+	assert(r < 0 && errno == ENOTCONN);
+
+	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
+	assert(r >= 0);
+
+	access.flags = UDRM_ACCESS_WRITE << 1;
+	r = ioctl(fd, UDRM_CMD_BEGIN_ACCESS, &access);
+	assert(r < 0 && errno == EINVAL);
+
+	access.flags = UDRM_ACCESS_WRITE;
+	r = ioctl(fd, UDRM_CMD_BEGIN_ACCESS, &access);
+	assert(r < 0 && errno == EPERM);
+
+	access.flags = 0;
+	r = ioctl(fd, UDRM_CMD_BEGIN_ACCESS, &access);
+	assert(r < 0 && errno == ENOENT);
+
+	r = ioctl(fd, UDRM_CMD_END_ACCESS, &access);
+	assert(r < 0 && errno == ENOENT);
+
+	close(fd);
+}
+
+/* make sure dumb buffer flags are validated and prefaulting works */
+static void test_api_dumb(void)
+{
+	struct drm_mode_create_dumb create = {};
+	struct drm_mode_map_dumb map = {};
+	uint8_t *p;
+	int r, fd, card;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
+	assert(r >= 0);
+
+	card = test_open_card();
+	assert(card >= 0);
+
+	create.width = 64;
+	create.height = 64;
+	create.bpp = 32;
+	create.flags = UDRM_DUMB_PREFAULT << 1;
+	r = ioctl(card, DRM_IOCTL_MODE_CREATE_DUMB, &create);
+	assert(r < 0 && errno == EINVAL);
+
+	create.flags = UDRM_DUMB_PREFAULT;
+	r = ioctl(card, DRM_IOCTL_MODE_CREATE_DUMB, &create);
+	assert(r >= 0);
+
+	map.handle = create.handle;
+	r = ioctl(card, DRM_IOCTL_MODE_MAP_DUMB, &map);
+	assert(r >= 0);
+
+	p = mmap(NULL, create.size, PROT_READ, MAP_SHARED, card, map.offset);
+	assert(p != MAP_FAILED);
+	assert(p[0] == 0 && p[create.size - 1] == 0);
+
+	munmap(p, create.size);
+	close(card);
+	close(fd);
+}
+
+/* make sure a write bracket on a write-combined object round-trips */
+static void test_api_access_write(void)
+{
+	struct drm_mode_create_dumb create = {};
+	struct udrm_cmd_access access = {};
+	struct drm_mode_map_dumb map = {};
+	uint8_t *p;
+	uint32_t seq;
+	int r, fd, card;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
+	assert(r >= 0);
+
+	card = test_open_card();
+	assert(card >= 0);
+
+	create.width = 64;
+	create.height = 64;
+	create.bpp = 32;
+	create.flags = UDRM_DUMB_WRITECOMBINE;
+	r = ioctl(card, DRM_IOCTL_MODE_CREATE_DUMB, &create);
+	assert(r >= 0);
+
+	map.handle = create.handle;
+	r = ioctl(card, DRM_IOCTL_MODE_MAP_DUMB, &map);
+	assert(r >= 0);
+
+	p = mmap(NULL, create.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		 card, map.offset);
+	assert(p != MAP_FAILED);
+
+	access.id = create.handle;
+	access.flags = UDRM_ACCESS_WRITE;
+	r = ioctl(card, DRM_IOCTL_UDRM_BEGIN_ACCESS, &access);
+	assert(r >= 0);
+	assert(access.seq & 1);
+	seq = access.seq;
+
+	r = ioctl(card, DRM_IOCTL_UDRM_BEGIN_ACCESS, &access);
+	assert(r < 0 && errno == EALREADY);
+
+	access.flags = 0;
+	r = ioctl(card, DRM_IOCTL_UDRM_BEGIN_ACCESS, &access);
+	assert(r < 0 && errno == EBUSY);
+
+	memset(p, 0xa5, create.size);
+
+	access.flags = UDRM_ACCESS_WRITE;
+	r = ioctl(card, DRM_IOCTL_UDRM_END_ACCESS, &access);
+	assert(r >= 0);
+	assert(access.seq == seq + 1);
+
+	access.flags = 0;
+	r = ioctl(card, DRM_IOCTL_UDRM_BEGIN_ACCESS, &access);
+	assert(r >= 0);
+	assert(access.seq == seq + 1);
+
+	assert(p[0] == 0xa5 && p[create.size - 1] == 0xa5);
+
+	r = ioctl(card, DRM_IOCTL_UDRM_END_ACCESS, &access);
+	assert(r >= 0);
+
+	access.flags = UDRM_ACCESS_WRITE;
+	r = ioctl(card, DRM_IOCTL_UDRM_END_ACCESS, &access);
+	assert(r < 0 && errno == EINVAL);
+
+	munmap(p, create.size);
+	close(card);
+	close(fd);
+}
+
+/* make sure FB_DAMAGE_CLIPS only accepts blobs of whole rectangles */
+static void test_api_damage(void)
+{
+	struct drm_set_client_cap cap = {
+		.capability = DRM_CLIENT_CAP_ATOMIC,
+		.value = 1,
+	};
+	struct udrm_damage_rect rects[2] = {
+		{ .x1 = 0, .y1 = 0, .x2 = 16, .y2 = 16 },
+		{ .x1 = -8, .y1 = -8, .x2 = 1 << 16, .y2 = 1 << 16 },
+	};
+	struct drm_mode_get_plane_res planes = {};
+	struct drm_mode_create_blob blob = {};
+	struct drm_mode_card_res res = {};
+	struct drm_mode_atomic atomic = {};
+	uint32_t objs[2], props[2], counts[2] = { 1, 1 };
+	uint64_t values[2] = {};
+	int r, fd, card;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
+	assert(r >= 0);
+
+	card = test_open_card();
+	assert(card >= 0);
+
+	r = ioctl(card, DRM_IOCTL_SET_CLIENT_CAP, &cap);
+	assert(r >= 0);
+
+	planes.count_planes = 1;
+	planes.plane_id_ptr = (uintptr_t)&objs[0];
+	r = ioctl(card, DRM_IOCTL_MODE_GETPLANERESOURCES, &planes);
+	assert(r >= 0 && planes.count_planes == 1);
+
+	res.count_crtcs = 1;
+	res.crtc_id_ptr = (uintptr_t)&objs[1];
+	r = ioctl(card, DRM_IOCTL_MODE_GETRESOURCES, &res);
+	assert(r >= 0 && res.count_crtcs == 1);
+
+	props[0] = test_find_prop(card, objs[0], DRM_MODE_OBJECT_PLANE,
+				  "FB_DAMAGE_CLIPS");
+	assert(props[0]);
+
+	/* the crtc is pulled into the commit, with a no-op property */
+	props[1] = test_find_prop(card, objs[1], DRM_MODE_OBJECT_CRTC,
+				  "OUT_FENCE_PTR");
+	assert(props[1]);
+
+	atomic.flags = DRM_MODE_ATOMIC_TEST_ONLY;
+	atomic.count_objs = 2;
+	atomic.objs_ptr = (uintptr_t)objs;
+	atomic.count_props_ptr = (uintptr_t)counts;
+	atomic.props_ptr = (uintptr_t)props;
+	atomic.prop_values_ptr = (uintptr_t)values;
+
+	values[0] = 0xffffff;
+	r = ioctl(card, DRM_IOCTL_MODE_ATOMIC, &atomic);
+	assert(r < 0 && errno == EINVAL);
+
+	blob.data = (uintptr_t)rects;
+	blob.length = sizeof(rects) - 4;
+	r = ioctl(card, DRM_IOCTL_MODE_CREATEPROPBLOB, &blob);
+	assert(r >= 0);
+
+	values[0] = blob.blob_id;
+	r = ioctl(card, DRM_IOCTL_MODE_ATOMIC, &atomic);
+	assert(r < 0 && errno == EINVAL);
+
+	/* rectangles beyond the fb are accepted, they are clipped later */
+	blob.length = sizeof(rects);
+	r = ioctl(card, DRM_IOCTL_MODE_CREATEPROPBLOB, &blob);
+	assert(r >= 0);
+
+	values[0] = blob.blob_id;
+	r = ioctl(card, DRM_IOCTL_MODE_ATOMIC, &atomic);
+	assert(r >= 0);
+
+	values[0] = 0;
+	r = ioctl(card, DRM_IOCTL_MODE_ATOMIC, &atomic);
+	assert(r >= 0);
+
+	close(card);
+	close(fd);
+}
+
+/* make sure the event queue starts out empty */
+static void test_api_events(void)
+{
+	struct pollfd pfd = {};
+	char buf[4096];
+	ssize_t l;
+	int r, fd;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
+	assert(r >= 0);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	r = poll(&pfd, 1, 0);
+	assert(r == 0);
+
+	l = read(fd, buf, sizeof(buf));
+	assert(l < 0 && errno == EAGAIN);
+
+	close(fd);
+}
+
+/* make sure FLIP_DONE is only accepted when negotiated */
+static void test_api_flips(void)
+{
+	struct udrm_cmd_register reg = {};
+	int r, fd;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
+	assert(r >= 0);
+
+	r = ioctl(fd, UDRM_CMD_FLIP_DONE, NULL);
+	assert(r < 0 && errno == EINVAL);
+
+	close(fd);
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_FLIP_DONE, NULL);
+	assert(r < 0 && errno == ENOTCONN);
+
+	reg.flags = UDRM_REGISTER_FLIP_ACK;
+	r = ioctl(fd, UDRM_CMD_REGISTER, &reg);
+	assert(r >= 0);
+
+	r = ioctl(fd, UDRM_CMD_FLIP_DONE, NULL);
+	assert(r < 0 && errno == EALREADY);
+
+	close(fd);
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	reg.flip_depth = 3;
+	r = ioctl(fd, UDRM_CMD_REGISTER, &reg);
+	assert(r < 0 && errno == EINVAL);
+
+	reg.flip_depth = 2;
+	r = ioctl(fd, UDRM_CMD_REGISTER, &reg);
+	assert(r >= 0);
+
+	r = ioctl(fd, UDRM_CMD_FLIP_DONE, NULL);
+	assert(r < 0 && errno == EALREADY);
+
+	close(fd);
+}
+
+/* make sure no flip completes while the frame before it is held */
+static void test_api_flip_depth(void)
+{
+	struct udrm_cmd_register reg = {
+		.flags = UDRM_REGISTER_FLIP_ACK,
+		.flip_depth = 2,
+	};
+	struct drm_event_vblank event;
+	uint32_t crtc, fbs[2];
+	ssize_t l;
+	int r, fd, card;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_REGISTER, &reg);
+	assert(r >= 0);
+
+	card = test_open_card();
+	assert(card >= 0);
+
+	fbs[0] = test_add_fb(card, NULL);
+	fbs[1] = test_add_fb(card, NULL);
+
+	/* the first frame completes, but stays held */
+	crtc = test_modeset(fd, card, fbs[0]);
+
+	r = test_page_flip(card, crtc, fbs[1]);
+	assert(r >= 0);
+	assert(!test_poll(card, POLLIN, 100));
+
+	r = ioctl(fd, UDRM_CMD_FLIP_DONE, NULL);
+	assert(r >= 0);
+	assert(test_poll(card, POLLIN, 1000) & POLLIN);
+
+	l = read(card, &event, sizeof(event));
+	assert(l == sizeof(event));
+	assert(event.base.type == DRM_EVENT_FLIP_COMPLETE);
+
+	/* the third frame waits for the second one */
+	r = test_page_flip(card, crtc, fbs[0]);
+	assert(r >= 0);
+	assert(!test_poll(card, POLLIN, 100));
+
+	r = ioctl(fd, UDRM_CMD_FLIP_DONE, NULL);
+	assert(r >= 0);
+	assert(test_poll(card, POLLIN, 1000) & POLLIN);
+
+	r = ioctl(fd, UDRM_CMD_FLIP_DONE, NULL);
+	assert(r >= 0);
+
+	close(card);
+	close(fd);
+}
+
+/* make sure mailbox mode only signals claimable frames with POLLPRI */
+static void test_api_mailbox(void)
+{
+	struct udrm_cmd_register reg = {};
+	struct udrm_cmd_grab grab = {};
+	char buf[4096];
+	ssize_t l;
+	int r, fd, card;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_GRAB, &grab);
+	assert(r < 0 && errno == ENOTCONN);
+
+	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
+	assert(r >= 0);
+
+	r = ioctl(fd, UDRM_CMD_GRAB, &grab);
+	assert(r < 0 && errno == EINVAL);
+
+	close(fd);
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	reg.flags = UDRM_REGISTER_MAILBOX;
+	reg.n_heads = 2;
+	r = ioctl(fd, UDRM_CMD_REGISTER, &reg);
+	assert(r >= 0);
+
+	r = ioctl(fd, UDRM_CMD_GRAB, &grab);
+	assert(r < 0 && errno == EAGAIN);
+
+	grab.head = 2;
+	r = ioctl(fd, UDRM_CMD_GRAB, &grab);
+	assert(r < 0 && errno == ENODEV);
+
+	close(fd);
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	reg.n_heads = 1;
+	r = ioctl(fd, UDRM_CMD_REGISTER, &reg);
+	assert(r >= 0);
+	assert(!test_poll(fd, POLLIN | POLLPRI, 0));
+
+	card = test_open_card();
+	assert(card >= 0);
+
+	test_modeset(fd, card, test_add_fb(card, NULL));
+
+	do {
+		l = read(fd, buf, sizeof(buf));
+	} while (l > 0);
+	assert(l < 0 && errno == EAGAIN);
+
+	assert(test_poll(fd, POLLIN | POLLPRI, 0) == POLLPRI);
+
+	/* without capacity, the modeset still reports its full-frame damage */
+	grab.head = 0;
+	grab.n_clips = 0;
+	r = ioctl(fd, UDRM_CMD_GRAB, &grab);
+	assert(r >= 0 && grab.n_clips == 1);
+	assert(!test_poll(fd, POLLIN | POLLPRI, 0));
+
+	close(card);
+	close(fd);
+}
+
+/* make sure vblank overrides are validated */
+static void test_api_vblank(void)
+{
+	struct udrm_cmd_vblank vblank = {};
+	int r, fd;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	r = ioctl(fd, UDRM_CMD_VBLANK, &vblank);
+	assert(r < 0 && errno == ENOTCONN);
+
+	r = ioctl(fd, UDRM_CMD_REGISTER, NULL);
+	assert(r >= 0);
+
+	vblank.period_ns = 1;
+	r = ioctl(fd, UDRM_CMD_VBLANK, &vblank);
+	assert(r < 0 && errno == EINVAL);
+
+	vblank.period_ns = 1000000000ULL / 60;
+	r = ioctl(fd, UDRM_CMD_VBLANK, &vblank);
+	assert(r >= 0);
+
+	vblank.period_ns = 0;
+	r = ioctl(fd, UDRM_CMD_VBLANK, &vblank);
+	assert(r >= 0);
+
+	close(fd);
+}
+
+/* make sure heads are addressed individually */
+static void test_api_heads(void)
+{
+	struct udrm_cmd_register reg = {};
+	struct udrm_cmd_plug plug = {};
+	int r, fd;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	reg.n_heads = 1024;
+	r = ioctl(fd, UDRM_CMD_REGISTER, &reg);
+	assert(r < 0 && errno == EINVAL);
+
+	reg.n_heads = 2;
+	r = ioctl(fd, UDRM_CMD_REGISTER, &reg);
+	assert(r >= 0);
+
+	plug.head = 2;
+	r = ioctl(fd, UDRM_CMD_PLUG, &plug);
+	assert(r < 0 && errno == ENODEV);
+
+	plug.head = 1;
+	r = ioctl(fd, UDRM_CMD_PLUG, &plug);
+	assert(r >= 0);
+
+	r = ioctl(fd, UDRM_CMD_UNPLUG, 0);
+	assert(r < 0 && errno == EALREADY);
+
+	r = ioctl(fd, UDRM_CMD_UNPLUG, 2);
+	assert(r < 0 && errno == ENODEV);
+
+	r = ioctl(fd, UDRM_CMD_UNPLUG, 1);
+	assert(r >= 0);
+
+	close(fd);
+}
+
+/* make sure only known formats can be declared, with custom limits */
+static void test_api_formats(void)
+{
+	uint32_t formats[] = { DRM_FORMAT_XRGB8888, DRM_FORMAT_NV12 };
+	uint64_t modifiers[] = { DRM_FORMAT_MOD_LINEAR };
+	uint32_t unknown = 0;
+	struct udrm_cmd_register reg = {};
+	int r, fd;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	reg.n_formats = 1;
+	reg.ptr_formats = (uintptr_t)&unknown;
+	r = ioctl(fd, UDRM_CMD_REGISTER, &reg);
+	assert(r < 0 && errno == EINVAL);
+
+	reg.n_formats = 1024;
+	reg.ptr_formats = (uintptr_t)formats;
+	r = ioctl(fd, UDRM_CMD_REGISTER, &reg);
+	assert(r < 0 && errno == EINVAL);
+
+	reg.n_formats = sizeof(formats) / sizeof(*formats);
+	reg.n_modifiers = sizeof(modifiers) / sizeof(*modifiers);
+	reg.ptr_modifiers = (uintptr_t)modifiers;
+	reg.min_width = 16;
+	reg.min_height = 16;
+	reg.max_width = 7680;
+	reg.max_height = 4320;
+	reg.preferred_depth = 30;
+	r = ioctl(fd, UDRM_CMD_REGISTER, &reg);
+	assert(r >= 0);
+
+	close(fd);
+}
+
+/* make sure SUBMIT runs commands in order and reports each result */
+static void test_api_submit(void)
+{
+	struct udrm_cmd_plug plug = {};
+	struct udrm_submit_entry entries[] = {
+		{ .cmd = UDRM_CMD_REGISTER, .arg = 0 },
+		{ .cmd = UDRM_CMD_PLUG, .arg = (uintptr_t)&plug },
+		{ .cmd = UDRM_CMD_PLUG, .arg = (uintptr_t)&plug },
+		{ .cmd = UDRM_CMD_UNPLUG, .arg = 0 },
+	};
+	struct udrm_cmd_submit submit = {};
+	int r, fd;
+
+	fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(fd >= 0);
+
+	submit.flags = UDRM_SUBMIT_STOP_ON_ERROR << 1;
+	r = ioctl(fd, UDRM_CMD_SUBMIT, &submit);
+	assert(r < 0 && errno == EINVAL);
+
+	submit.flags = UDRM_SUBMIT_STOP_ON_ERROR;
+	submit.n_entries = sizeof(entries) / sizeof(*entries);
+	submit.ptr_entries = (uintptr_t)entries;
+	r = ioctl(fd, UDRM_CMD_SUBMIT, &submit);
+	assert(r >= 0);
+	assert(entries[0].result == 0);
+	assert(entries[1].result == 0);
+	assert(entries[2].result == -EALREADY);
+	assert(entries[3].result == -ECANCELED);
+
+	entries[0].cmd = UDRM_CMD_SUBMIT;
+	entries[0].arg = (uintptr_t)&submit;
+	submit.flags = 0;
+	r = ioctl(fd, UDRM_CMD_SUBMIT, &submit);
+	assert(r >= 0);
+	assert(entries[0].result == -ENOTTY);
+	assert(entries[1].result == -EALREADY);
+	assert(entries[2].result == -EALREADY);
+	assert(entries[3].result == 0);
+
 	close(fd);
 }
 
@@ -146,6 +1477,27 @@ int test_api(void)
 	test_api_cdev();
 	test_api_registration();
 	test_api_plugging();
+	test_api_plug_modes();
+	test_api_mapping();
+	test_api_map_import();
+	test_api_bo_cache();
+	test_api_prime();
+	test_api_planar();
+	test_api_probe();
+	test_api_open();
+	test_api_hotplug();
+	test_api_dumb();
+	test_api_access();
+	test_api_access_write();
+	test_api_damage();
+	test_api_events();
+	test_api_flips();
+	test_api_flip_depth();
+	test_api_mailbox();
+	test_api_vblank();
+	test_api_heads();
+	test_api_formats();
+	test_api_submit();
 
 	return TEST_OK;
 }